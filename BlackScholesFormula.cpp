@@ -60,3 +60,11 @@ double BlackScholesPut(double S, double K, double r, double q, double sigma, dou
   	double d2 = d1 - sigma*sqrt(expiry);
   	return -S*exp(-q*(expiry))*CNDist(-d1) + K*exp(-r*(expiry))*CNDist(-d2);
 };
+
+/**
+*    Analytical vega (dV/dsigma) of a European call or put
+*/
+double BlackScholesVega(double S, double K, double r, double q, double sigma, double expiry) {
+	double d1 = (log(S/K)+(r-q+sigma*sigma/2.0)*(expiry))/(sigma*sqrt(expiry));
+	return S*exp(-q*(expiry))*NDensity(d1)*sqrt(expiry);
+};
@@ -0,0 +1,104 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Prices an option to a target absolute error by grid refinement and Richardson extrapolation.
+*
+* */
+
+#include <cmath>
+#include "FDM_engines.h"
+
+using namespace std;
+
+/**
+ * Engine function of a pricing method
+ * Inputs : FDM_method method
+ * Output : FDM_engine, 0 for METHOD_BLACK_SCHOLES which has no grid
+ */
+FDM_engine engine_for_method(FDM_method method) {
+  switch(method) {
+  case METHOD_EXPLICIT: return ExplicitFDM;
+  case METHOD_IMPLICIT: return ImplicitFDM;
+  case METHOD_CN: return CN_FDM;
+  case METHOD_IMPLICIT_SOR: return ImplicitSORFDM;
+  case METHOD_CN_SOR: return CN_SORFDM;
+  default: return 0;
+  }
+}
+
+/**
+ * Solves once on (dx, dtau) and carries the price from the last whole time step to the full expiry
+ * with the grid theta, so the time truncation of the march does not spoil the error expansion
+ */
+static double solve_level(FDM_engine engine, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, FDM_workspace *ws, int solver_threads) {
+  FDM_options opts;
+  FDM_result res;
+
+  opts.workspace = ws;
+  opts.solver_threads = solver_threads;
+  opts.result = &res;
+  engine(S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &opts);
+  return res.price - res.theta*(expiry - res.expiry_solved);
+}
+
+// grid nodes M*N of one solve
+static long grid_nodes(double sigma, double expiry, double dx, double dtau) {
+  long M = 1 + ((2.5 - (-2.5))/dx);
+  long N = 1 + ((0.5*(sigma*sigma)*expiry)/dtau);
+  return M*N;
+}
+
+/**
+ * Prices an option to a target absolute error with the fewest grid nodes
+ *   Starting from dx = 0.1, dtau = 0.005 each level halves dx and quarters dtau. Keeping
+ *   w = dtau/dx^2 fixed keeps the explicit scheme stable and leaves the w-scaled boundary rows
+ *   of the engines unchanged between levels. With dtau ~ dx^2 the
+ *   leading error is O(dx^2) for every engine: the space error plus, for Explicit/Implicit, the
+ *   first order time error (Crank-Nicholson's second order time error is O(dx^4)). It shrinks by
+ *   4 per level, so two consecutive levels V_c, V_f give
+ *     V = V_f + (V_f - V_c)/3, with estimated error |V_f - V_c|/3,
+ *   and refinement stops as soon as that estimate is below tol, or before a solve would exceed
+ *   max_nodes grid nodes in total.
+ * Inputs: FDM_engine engine (ExplicitFDM, ImplicitFDM, CN_FDM, ImplicitSORFDM or CN_SORFDM)
+ *         double S, K, r, q, sigma, expiry, int call_or_put, amer_or_eur (as for the engines)
+ *         double tol (target absolute error)
+ *         long max_nodes (budget of grid nodes M*N summed over all solves)
+ *         FDM_workspace *ws (optional, reused by every solve)
+ *         int solver_threads (threads of each solve, see FDM_options; 1 when called from a pool)
+ * Output: double value (extrapolated value of option)
+ *         FDM_adaptive_result *res (optional), error estimate, finest grid and cost
+ */
+double price_to_tolerance(FDM_engine engine, double S, double K, double r, double q, double sigma, double expiry, int call_or_put, int amer_or_eur, double tol, long max_nodes, FDM_adaptive_result *res, FDM_workspace *ws, int solver_threads) {
+  double dx = 0.1, dtau = 0.005;
+  double coarse, fine, value, error = HUGE_VAL;
+  long nodes;
+  int solves = 1;
+
+  nodes = grid_nodes(sigma, expiry, dx, dtau);
+  coarse = solve_level(engine, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, ws, solver_threads);
+  value = coarse;
+
+  while(nodes + grid_nodes(sigma, expiry, 0.5*dx, 0.25*dtau) <= max_nodes) {
+    dx = 0.5*dx;
+    dtau = 0.25*dtau;
+    nodes += grid_nodes(sigma, expiry, dx, dtau);
+    solves++;
+
+    fine = solve_level(engine, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, ws, solver_threads);
+    value = fine + (fine - coarse)/3.0; // Richardson extrapolation, error ratio 4 per level
+    error = fabs(fine - coarse)/3.0;
+    if(error <= tol) break;
+    coarse = fine;
+  }
+
+  if(res != 0) {
+    res->value = value;
+    res->error_estimate = error;
+    res->dx = dx;
+    res->dtau = dtau;
+    res->nodes = nodes;
+    res->solves = solves;
+    res->converged = (error <= tol) ? 1 : 0;
+  }
+  return value;
+}
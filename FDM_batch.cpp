@@ -0,0 +1,617 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: prices batches of contracts on a work-stealing thread pool, and the --batch command line mode.
+*
+* */
+
+#include "FDM_batch.h"
+#include "FDM_profile.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+FDM_worker_state::~FDM_worker_state() {
+  workspace_free(&ws);
+  tridiag_factor_free(&implicit_op);
+  tridiag_factor_free(&cn_op);
+}
+
+// points opts at the workspace of the worker and, for the implicit and CN methods, at its factorization of the grid;
+// each solve stays on the worker's thread, the pool already runs one contract per thread
+static void worker_options(FDM_method method, double dx, double dtau, FDM_worker_state *state, FDM_options *opts) {
+  double w = dtau/(dx*dx);
+  int M = 1 + ((2.5 - (-2.5))/dx);
+
+  opts->workspace = &state->ws;
+  opts->solver_threads = 1;
+  if(method == METHOD_IMPLICIT) {
+    if(state->implicit_op.n != M || state->implicit_op.w != w) {
+      heat_operator_factor(M, w, 1.0, &state->implicit_op);
+    }
+    opts->factor = &state->implicit_op;
+  } else if(method == METHOD_CN) {
+    if(state->cn_op.n != M || state->cn_op.w != w) {
+      heat_operator_factor(M, w, 0.5, &state->cn_op);
+    }
+    opts->factor = &state->cn_op;
+  }
+}
+
+/**
+ * Prices one contract with the method it asks for, reusing the scratch state of the worker
+ * Inputs: FDM_contract c (contract and method)
+ *         double dx (step size in space)
+ *         double dtau (step size in time)
+ *         FDM_worker_state *state (workspace and factorizations of the calling thread)
+ * Output: double value (value of option)
+ */
+double price_contract(const FDM_contract &c, double dx, double dtau, FDM_worker_state *state) {
+  FDM_options opts;
+  FDM_engine engine = engine_for_method(c.method);
+
+  if(engine == 0) {
+    return (c.call_or_put > 0) ? BlackScholesCall(c.S, c.K, c.r, c.q, c.sigma, c.expiry)
+                               : BlackScholesPut(c.S, c.K, c.r, c.q, c.sigma, c.expiry);
+  }
+  worker_options(c.method, dx, dtau, state, &opts);
+  return engine(c.S, c.K, c.r, c.q, c.sigma, c.expiry, dx, dtau, c.call_or_put, c.amer_or_eur, &opts);
+}
+
+/**
+ * Price and greeks of one contract: delta, gamma and theta from the layers of the solve, vega and
+ * rho by central bumps that reuse the workspace and factorization of the worker. Black-Scholes
+ * contracts take the closed form vega and central bumps of the formula for the rest.
+ * Inputs: as price_contract
+ * Output: FDM_result *res, price and greeks
+ */
+void greeks_contract(const FDM_contract &c, double dx, double dtau, FDM_worker_state *state, FDM_result *res) {
+  FDM_options opts;
+
+  *res = FDM_result();
+  if(c.method == METHOD_BLACK_SCHOLES) {
+    double (*bs)(double, double, double, double, double, double) = (c.call_or_put > 0) ? BlackScholesCall : BlackScholesPut;
+    double dS = 1e-4*c.S, dt = min(1e-4, 0.5*c.expiry), dr = 1e-4;
+
+    res->price = bs(c.S, c.K, c.r, c.q, c.sigma, c.expiry);
+    res->delta = (bs(c.S+dS, c.K, c.r, c.q, c.sigma, c.expiry) - bs(c.S-dS, c.K, c.r, c.q, c.sigma, c.expiry))/(2.0*dS);
+    res->gamma = (bs(c.S+dS, c.K, c.r, c.q, c.sigma, c.expiry) - 2.0*res->price + bs(c.S-dS, c.K, c.r, c.q, c.sigma, c.expiry))/(dS*dS);
+    res->theta = -(bs(c.S, c.K, c.r, c.q, c.sigma, c.expiry+dt) - bs(c.S, c.K, c.r, c.q, c.sigma, c.expiry-dt))/(2.0*dt);
+    res->vega = BlackScholesVega(c.S, c.K, c.r, c.q, c.sigma, c.expiry);
+    res->rho = (bs(c.S, c.K, c.r+dr, c.q, c.sigma, c.expiry) - bs(c.S, c.K, c.r-dr, c.q, c.sigma, c.expiry))/(2.0*dr);
+    res->expiry_solved = c.expiry;
+    return;
+  }
+
+  worker_options(c.method, dx, dtau, state, &opts);
+  opts.result = res;
+  opts.bump_greeks = 1;
+  engine_for_method(c.method)(c.S, c.K, c.r, c.q, c.sigma, c.expiry, dx, dtau, c.call_or_put, c.amer_or_eur, &opts);
+}
+
+FDM_thread_pool::FDM_thread_pool(int n_threads) : queues(n_threads > 0 ? n_threads : max(1u, thread::hardware_concurrency())) {
+  int k;
+
+  for(k=0; k<(int)queues.size(); k++) {
+    threads.push_back(thread(&FDM_thread_pool::worker_loop, this, k));
+  }
+}
+
+FDM_thread_pool::~FDM_thread_pool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for(size_t k=0; k<threads.size(); k++) {
+    threads[k].join();
+  }
+}
+
+/**
+ * Runs task(i, worker) for every i in [0,n) on the pool and waits for all of them
+ *   If tasks throw, the other tasks still run and the first exception is rethrown here.
+ */
+void FDM_thread_pool::run(int n, const function<void(int, int)> &task) {
+  int k, i, n_workers = size();
+
+  if(n <= 0) return;
+
+  // one run at a time: the queues, current and remaining belong to a single run
+  lock_guard<mutex> caller(run_lock);
+  unique_lock<mutex> guard(lock);
+  // workers still leaving the previous run must not pick up tasks of this one
+  done_cv.wait(guard, [this] { return active == 0; });
+
+  // deal contiguous blocks so neighbouring contracts (often on the same grid) share a worker
+  for(k=0; k<n_workers; k++) {
+    lock_guard<mutex> queue_guard(queues[k].lock);
+    for(i=(int)((long)n*k/n_workers); i<(int)((long)n*(k+1)/n_workers); i++) {
+      queues[k].tasks.push_back(i);
+    }
+  }
+
+  current = &task;
+  remaining = n;
+  generation++;
+  start_cv.notify_all();
+  done_cv.wait(guard, [this] { return remaining == 0; });
+  current = 0;
+  if(error) {
+    exception_ptr failed = error;
+    error = nullptr;
+    rethrow_exception(failed);
+  }
+}
+
+// takes from the back of the own queue, otherwise steals from the front of another
+bool FDM_thread_pool::next_task(int worker, int *task) {
+  int k, n_workers = size();
+
+  {
+    lock_guard<mutex> guard(queues[worker].lock);
+    if(!queues[worker].tasks.empty()) {
+      *task = queues[worker].tasks.back();
+      queues[worker].tasks.pop_back();
+      return true;
+    }
+  }
+  for(k=1; k<n_workers; k++) {
+    task_queue &victim = queues[(worker+k)%n_workers];
+    lock_guard<mutex> guard(victim.lock);
+    if(!victim.tasks.empty()) {
+      *task = victim.tasks.front();
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void FDM_thread_pool::worker_loop(int worker) {
+  long seen = 0;
+  int task, done;
+  const function<void(int, int)> *job;
+
+  for(;;) {
+    {
+      unique_lock<mutex> guard(lock);
+      start_cv.wait(guard, [&] { return stopping || generation != seen; });
+      if(stopping) return;
+      seen = generation;
+      job = current;
+      active++;
+    }
+    done = 0;
+    while(job != 0 && next_task(worker, &task)) {
+      // a task that throws must not end the thread; the first exception is rethrown by run
+      try {
+        (*job)(task, worker);
+      } catch(...) {
+        lock_guard<mutex> guard(lock);
+        if(!error) error = current_exception();
+      }
+      done++;
+    }
+    {
+      lock_guard<mutex> guard(lock);
+      remaining -= done;
+      active--;
+      if(remaining == 0 || active == 0) done_cv.notify_all();
+    }
+  }
+}
+
+FDM_batch_pricer::FDM_batch_pricer(int n_threads) : pool(n_threads), states(pool.size()) {
+}
+
+// sizes the workspace and factors the implicit and CN matrices of every worker state for the grid (dx, dtau)
+void FDM_batch_pricer::warm_up(double dx, double dtau) {
+  FDM_options opts;
+
+  for(size_t k=0; k<states.size(); k++) {
+    workspace_reserve(&states[k].ws, 1 + ((2.5 - (-2.5))/dx));
+    worker_options(METHOD_IMPLICIT, dx, dtau, &states[k], &opts);
+    worker_options(METHOD_CN, dx, dtau, &states[k], &opts);
+  }
+}
+
+/**
+ * Prices n contracts on the pool
+ * Inputs: int n (number of contracts)
+ *         FDM_contract *contracts (length=n)
+ *         double dx (step size in space)
+ *         double dtau (step size in time)
+ * Output: double *values (length=n), values[i] is the price of contracts[i]
+ *         FDM_batch_stats *stats (optional), wall clock time and throughput
+ */
+void FDM_batch_pricer::price(int n, const FDM_contract *contracts, double dx, double dtau, double *values, FDM_batch_stats *stats) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  if(precision == PRECISION_MIXED) {
+    price_mixed(n, contracts, dx, dtau, values);
+  } else if(cache != 0 || surfaces != 0) {
+    pool.run(n, [&](int i, int worker) {
+      FDM_options opts;
+
+      if(surfaces != 0 && surfaces->price(contracts[i], dx, dtau, &values[i])) return;
+      if(cache == 0) {
+        values[i] = price_contract(contracts[i], dx, dtau, &states[worker]);
+        return;
+      }
+      worker_options(contracts[i].method, dx, dtau, &states[worker], &opts);
+      values[i] = cache->price(contracts[i], dx, dtau, &opts);
+    });
+  } else {
+    pool.run(n, [&](int i, int worker) {
+      values[i] = price_contract(contracts[i], dx, dtau, &states[worker]);
+    });
+  }
+
+  if(stats != 0) {
+    stats->n_options = n;
+    stats->n_threads = pool.size();
+    stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats->options_per_second = (stats->seconds > 0.0) ? n/stats->seconds : 0.0;
+  }
+}
+
+/**
+ * Prices n contracts on the pool with their greeks (see greeks_contract)
+ * Inputs: as price
+ * Output: FDM_result *results (length=n), price and greeks of contracts[i]
+ *         FDM_batch_stats *stats (optional), wall clock time and throughput
+ */
+void FDM_batch_pricer::price_greeks(int n, const FDM_contract *contracts, double dx, double dtau, FDM_result *results, FDM_batch_stats *stats) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  pool.run(n, [&](int i, int worker) {
+    greeks_contract(contracts[i], dx, dtau, &states[worker], &results[i]);
+  });
+
+  if(stats != 0) {
+    stats->n_options = n;
+    stats->n_threads = pool.size();
+    stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats->options_per_second = (stats->seconds > 0.0) ? n/stats->seconds : 0.0;
+  }
+}
+
+/**
+ * price() in PRECISION_MIXED: the implicit and CN contracts are sorted by method and sigma^2*T,
+ * so the lanes of a pack march about as many steps, and priced FDM_PACK_MIXED_LANES at a time
+ * by the pack engines with the factorization of the worker; one task per pack, then one per
+ * contract of the other methods.
+ */
+void FDM_batch_pricer::price_mixed(int n, const FDM_contract *contracts, double dx, double dtau, double *values) {
+  vector<int> packed, single, pack_start;
+  int i;
+
+  for(i=0; i<n; i++) {
+    if(contracts[i].method == METHOD_IMPLICIT || contracts[i].method == METHOD_CN) packed.push_back(i);
+    else single.push_back(i);
+  }
+  sort(packed.begin(), packed.end(), [&](int u, int v) {
+    const FDM_contract &a = contracts[u], &b = contracts[v];
+    if(a.method != b.method) return a.method < b.method;
+    return a.sigma*a.sigma*a.expiry < b.sigma*b.sigma*b.expiry;
+  });
+  for(i=0; i<(int)packed.size(); i++) {
+    if(pack_start.empty() || i - pack_start.back() == FDM_PACK_MIXED_LANES || contracts[packed[i]].method != contracts[packed[i-1]].method) {
+      pack_start.push_back(i);
+    }
+  }
+  pack_start.push_back((int)packed.size());
+
+  int n_packs = (int)pack_start.size() - 1;
+  pool.run(n_packs + (int)single.size(), [&](int task, int worker) {
+    FDM_worker_state *state = &states[worker];
+
+    if(task >= n_packs) {
+      values[single[task-n_packs]] = price_contract(contracts[single[task-n_packs]], dx, dtau, state);
+      return;
+    }
+
+    FDM_contract pack[FDM_PACK_MIXED_LANES];
+    double pack_values[FDM_PACK_MIXED_LANES];
+    FDM_options opts;
+    int k, size = pack_start[task+1] - pack_start[task];
+    int implicit = (contracts[packed[pack_start[task]]].method == METHOD_IMPLICIT);
+
+    for(k=0; k<size; k++) {
+      pack[k] = contracts[packed[pack_start[task]+k]];
+    }
+    worker_options(implicit ? METHOD_IMPLICIT : METHOD_CN, dx, dtau, state, &opts);
+    opts.precision = PRECISION_MIXED;
+    opts.precision_tol = precision_tol;
+    if(implicit) ImplicitFDM_pack(size, pack, dx, dtau, pack_values, &opts);
+    else CN_FDM_pack(size, pack, dx, dtau, pack_values, &opts);
+    for(k=0; k<size; k++) {
+      values[packed[pack_start[task]+k]] = pack_values[k];
+    }
+  });
+}
+
+/**
+ * Prices n contracts on the pool, each to a target absolute error (see price_to_tolerance)
+ * Inputs: int n (number of contracts)
+ *         FDM_contract *contracts (length=n)
+ *         double tol (target absolute error)
+ *         long max_nodes (grid node budget per contract)
+ * Output: double *values (length=n), values[i] is the price of contracts[i]
+ *         FDM_adaptive_result *details (optional, length=n), error estimate and cost per contract
+ *         FDM_batch_stats *stats (optional), wall clock time and throughput
+ */
+void FDM_batch_pricer::price_to_tolerance(int n, const FDM_contract *contracts, double tol, long max_nodes, double *values, FDM_adaptive_result *details, FDM_batch_stats *stats) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  pool.run(n, [&](int i, int worker) {
+    const FDM_contract &c = contracts[i];
+    FDM_engine engine = engine_for_method(c.method);
+    FDM_adaptive_result res;
+
+    if(engine == 0) {
+      // closed form, exact for the purpose of the error target
+      res.value = (c.call_or_put > 0) ? BlackScholesCall(c.S, c.K, c.r, c.q, c.sigma, c.expiry)
+                                      : BlackScholesPut(c.S, c.K, c.r, c.q, c.sigma, c.expiry);
+      res.converged = 1;
+    } else {
+      ::price_to_tolerance(engine, c.S, c.K, c.r, c.q, c.sigma, c.expiry, c.call_or_put, c.amer_or_eur, tol, max_nodes, &res, &states[worker].ws, 1);
+    }
+    values[i] = res.value;
+    if(details != 0) details[i] = res;
+  });
+
+  if(stats != 0) {
+    stats->n_options = n;
+    stats->n_threads = pool.size();
+    stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats->options_per_second = (stats->seconds > 0.0) ? n/stats->seconds : 0.0;
+  }
+}
+
+/**
+ * Implied vols of n quotes on the pool (see implied_vol). The sigma of each contract is ignored.
+ * A worker reuses its workspace and its implicit / CN factorization for every iteration of every
+ * quote it inverts; METHOD_BLACK_SCHOLES quotes are inverted in closed form.
+ * Inputs: int n (number of quotes)
+ *         FDM_contract *quotes (length=n)
+ *         double *prices (length=n), quoted prices
+ *         double dx (step size in space)
+ *         double dtau (step size in time)
+ * Output: double *vols (length=n), vols[i] is the implied vol of prices[i], NaN if there is none
+ *         FDM_implied_result *details (optional, length=n), price error and cost per quote
+ *         FDM_batch_stats *stats (optional), wall clock time and throughput
+ */
+void FDM_batch_pricer::implied_vols(int n, const FDM_contract *quotes, const double *prices, double dx, double dtau, double *vols, FDM_implied_result *details, FDM_batch_stats *stats) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  pool.run(n, [&](int i, int worker) {
+    const FDM_contract &c = quotes[i];
+    FDM_engine engine = engine_for_method(c.method);
+    FDM_worker_state *state = &states[worker];
+    FDM_implied_result res;
+    FDM_options opts;
+
+    if(engine == 0) {
+      res.vol = black_scholes_implied_vol(prices[i], c.S, c.K, c.r, c.q, c.expiry, c.call_or_put);
+      res.converged = std::isnan(res.vol) ? 0 : 1;
+    } else {
+      worker_options(c.method, dx, dtau, state, &opts);
+      implied_vol(engine, prices[i], c.S, c.K, c.r, c.q, c.expiry, dx, dtau, c.call_or_put, c.amer_or_eur, &opts, &res);
+    }
+    vols[i] = res.vol;
+    if(details != 0) details[i] = res;
+  });
+
+  if(stats != 0) {
+    stats->n_options = n;
+    stats->n_threads = pool.size();
+    stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stats->options_per_second = (stats->seconds > 0.0) ? n/stats->seconds : 0.0;
+  }
+}
+
+// reads a whole field as a finite number
+static bool parse_number(const string &field, double *value) {
+  char *end;
+
+  if(field.empty()) return false;
+  *value = strtod(field.c_str(), &end);
+  return *end == '\0' && isfinite(*value);
+}
+
+// parses one line "S,K,r,q,sigma,T,type,style,method" of a batch file, followed by the quoted
+// price when price is not 0; false unless every number is finite and S, K, sigma and T are > 0
+bool parse_contract(const string &line, FDM_contract *c, double *price) {
+  string field[10];
+  stringstream ss(line);
+  int k, n_fields = (price != 0) ? 10 : 9;
+
+  for(k=0; k<n_fields; k++) {
+    if(!getline(ss, field[k], ',')) return false;
+    field[k].erase(0, field[k].find_first_not_of(" \t\r"));
+    field[k].erase(field[k].find_last_not_of(" \t\r")+1);
+  }
+
+  if(!parse_number(field[0], &c->S) || !parse_number(field[1], &c->K) || !parse_number(field[2], &c->r) ||
+     !parse_number(field[3], &c->q) || !parse_number(field[4], &c->sigma) || !parse_number(field[5], &c->expiry)) {
+    return false;
+  }
+  if(c->S <= 0.0 || c->K <= 0.0 || c->sigma <= 0.0 || c->expiry <= 0.0) return false;
+
+  if(field[6] == "call") c->call_or_put = 1;
+  else if(field[6] == "put") c->call_or_put = -1;
+  else return false;
+
+  if(field[7] == "european") c->amer_or_eur = 0;
+  else if(field[7] == "american") c->amer_or_eur = 1;
+  else return false;
+
+  if(field[8] == "bs") c->method = METHOD_BLACK_SCHOLES;
+  else if(field[8] == "explicit") c->method = METHOD_EXPLICIT;
+  else if(field[8] == "implicit") c->method = METHOD_IMPLICIT;
+  else if(field[8] == "cn") c->method = METHOD_CN;
+  else if(field[8] == "implicit_sor") c->method = METHOD_IMPLICIT_SOR;
+  else if(field[8] == "cn_sor") c->method = METHOD_CN_SOR;
+  else return false;
+
+  if(price != 0 && !parse_number(field[9], price)) return false;
+  return true;
+}
+
+// a grid every engine can march: dx and dtau finite and positive, and from 4 to max_nodes points
+// in space on x = log(S/K) from -2.5 to 2.5, so the factorizations built up front fit in memory
+bool valid_grid(double dx, double dtau, long max_nodes) {
+  if(!(isfinite(dx) && dx > 0.0 && isfinite(dtau) && dtau > 0.0)) return false;
+  double M = 1.0 + (2.5 - (-2.5))/dx;
+  return M >= 4.0 && M <= (double)max_nodes;
+}
+
+/**
+ * Command line batch mode:
+ *   ./FDM --batch <file|-> [--threads n] [--dx 0.05] [--dtau 0.00125] [--tol err [--max-nodes n]] [--implied]
+ *         [--precision double|mixed [--precision-tol err]] [--cache-mb n] [--surfaces file] [--save-surfaces file]
+ * Each non-empty line of the file that does not start with '#' is a contract
+ *   S,K,r,q,sigma,T,call|put,european|american,bs|explicit|implicit|cn|implicit_sor|cn_sor
+ * Prices are printed one per line in input order; the throughput goes to stderr. dx and dtau must be
+ * finite and positive, with 4 to --max-nodes points in space, or the run stops before reading the file.
+ * With --tol every contract is refined until the estimated absolute error is below err, and each
+ * line also carries the error estimate and the grid nodes used.
+ * With --implied each line ends with a quoted price after the method, the sigma field is ignored,
+ * and the output is the implied vol with the price error and the engine solves it took.
+ * With --precision mixed the implicit and CN contracts are marched in packs with float solves,
+ * each within about err (default 1e-5) of its double price.
+ * With --cache-mb contracts sharing (r, q, sigma, T, type, style, method) are read from one cached
+ * final layer of at most n MB in total, and the hits and misses go to stderr.
+ * With --surfaces the contracts found in a surface file are read from it instead of solved, and
+ * --save-surfaces writes the layers solved by the run (all of them, or those left in the cache of
+ * --cache-mb) to a surface file for the next one.
+ */
+int batch_main(int argc, char **argv) {
+  const char *path = 0, *profile_path = 0, *surfaces_path = 0, *save_path = 0;
+  int n_threads = 0, k, line_no = 0, implied = 0;
+  double dx = 0.05, dtau = 0.00125, tol = 0.0, precision_tol = 1e-5, cache_mb = 0.0;
+  FDM_precision precision = PRECISION_DOUBLE;
+  long max_nodes = 50000000;
+  vector<FDM_contract> contracts;
+  vector<double> quotes;
+  string line;
+  FDM_contract c;
+  double quote;
+
+  for(k=1; k<argc; k++) {
+    if(strcmp(argv[k], "--batch") == 0 && k+1 < argc) path = argv[++k];
+    else if(strcmp(argv[k], "--threads") == 0 && k+1 < argc) n_threads = atoi(argv[++k]);
+    else if(strcmp(argv[k], "--dx") == 0 && k+1 < argc) dx = atof(argv[++k]);
+    else if(strcmp(argv[k], "--dtau") == 0 && k+1 < argc) dtau = atof(argv[++k]);
+    else if(strcmp(argv[k], "--tol") == 0 && k+1 < argc) tol = atof(argv[++k]);
+    else if(strcmp(argv[k], "--max-nodes") == 0 && k+1 < argc) max_nodes = atol(argv[++k]);
+    else if(strcmp(argv[k], "--profile") == 0 && k+1 < argc) profile_path = argv[++k];
+    else if(strcmp(argv[k], "--implied") == 0) implied = 1;
+    else if(strcmp(argv[k], "--precision") == 0 && k+1 < argc && strcmp(argv[k+1], "double") == 0) { precision = PRECISION_DOUBLE; k++; }
+    else if(strcmp(argv[k], "--precision") == 0 && k+1 < argc && strcmp(argv[k+1], "mixed") == 0) { precision = PRECISION_MIXED; k++; }
+    else if(strcmp(argv[k], "--precision-tol") == 0 && k+1 < argc) precision_tol = atof(argv[++k]);
+    else if(strcmp(argv[k], "--cache-mb") == 0 && k+1 < argc) cache_mb = atof(argv[++k]);
+    else if(strcmp(argv[k], "--surfaces") == 0 && k+1 < argc) surfaces_path = argv[++k];
+    else if(strcmp(argv[k], "--save-surfaces") == 0 && k+1 < argc) save_path = argv[++k];
+    else {
+      cerr << "unknown argument " << argv[k] << endl;
+      return 1;
+    }
+  }
+  if(!valid_grid(dx, dtau, max_nodes)) {
+    cerr << "--dx and --dtau must be finite and > 0, with 1+5/dx from 4 to " << max_nodes << " nodes" << endl;
+    return 1;
+  }
+
+  ifstream file;
+  if(path != 0 && strcmp(path, "-") != 0) {
+    file.open(path);
+    if(!file) {
+      cerr << "cannot open " << path << endl;
+      return 1;
+    }
+  }
+  istream &in = (path != 0 && strcmp(path, "-") != 0) ? file : cin;
+
+  while(getline(in, line)) {
+    line_no++;
+    if(line.find_first_not_of(" \t\r") == string::npos || line[0] == '#') continue;
+    if(!parse_contract(line, &c, implied ? &quote : 0)) {
+      cerr << "line " << line_no << ": expected S,K,r,q,sigma,T,call|put,european|american,method" << (implied ? ",price" : "")
+           << " with finite numbers and S, K, sigma, T > 0" << endl;
+      return 1;
+    }
+    contracts.push_back(c);
+    if(implied) quotes.push_back(quote);
+  }
+
+  vector<double> values(contracts.size());
+  FDM_batch_pricer pricer(n_threads);
+  FDM_batch_stats stats;
+
+  FDM_surface_cache cache((cache_mb > 0.0) ? (size_t)(cache_mb*1048576.0) : (size_t)-1);
+  FDM_surface_file surfaces;
+
+  pricer.set_precision(precision, precision_tol);
+  if(cache_mb > 0.0 || save_path != 0) pricer.set_cache(&cache);
+  if(surfaces_path != 0) {
+    if(!surfaces.open(surfaces_path)) {
+      cerr << "cannot map surface file " << surfaces_path << endl;
+      return 1;
+    }
+    pricer.set_surfaces(&surfaces);
+  }
+
+  if(implied) {
+    vector<FDM_implied_result> details(contracts.size());
+
+    pricer.implied_vols((int)contracts.size(), contracts.data(), quotes.data(), dx, dtau, values.data(), details.data(), &stats);
+    for(size_t i=0; i<values.size(); i++) {
+      cout << fixed << setprecision(8) << values[i] << ',' << scientific << setprecision(2) << details[i].price_error
+           << ',' << details[i].solves << (details[i].converged ? "" : ",not converged") << endl;
+    }
+  } else if(tol > 0.0) {
+    vector<FDM_adaptive_result> details(contracts.size());
+
+    pricer.price_to_tolerance((int)contracts.size(), contracts.data(), tol, max_nodes, values.data(), details.data(), &stats);
+    for(size_t i=0; i<values.size(); i++) {
+      cout << fixed << setprecision(6) << values[i] << ',' << scientific << setprecision(2) << details[i].error_estimate
+           << ',' << details[i].nodes << (details[i].converged ? "" : ",not converged") << endl;
+    }
+  } else {
+    pricer.price((int)contracts.size(), contracts.data(), dx, dtau, values.data(), &stats);
+    for(size_t i=0; i<values.size(); i++) {
+      cout << fixed << setprecision(6) << values[i] << endl;
+    }
+  }
+  cerr << fixed << "priced " << stats.n_options << " options on " << stats.n_threads << " threads in "
+       << setprecision(3) << stats.seconds << " s (" << setprecision(1) << stats.options_per_second << " options/s)" << endl;
+  if(save_path != 0 && !write_surface_file(save_path, cache.contents())) {
+    cerr << "cannot write surface file " << save_path << endl;
+    return 1;
+  }
+  if(cache_mb > 0.0 || save_path != 0) {
+    FDM_cache_stats cs = cache.stats();
+    cerr << "surface cache: " << cs.hits << " hits, " << cs.misses << " misses, " << cs.evictions << " evictions, "
+         << cs.entries << " layers in " << setprecision(1) << cs.bytes/1048576.0 << " MB" << endl;
+  }
+
+  // phase timers and counters of the workers, filled only in a build with -DFDM_INSTRUMENT
+  if(profile_path != 0) {
+    ofstream profile(profile_path);
+    profile_dump_json(profile);
+  }
+
+  return 0;
+}
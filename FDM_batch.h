@@ -0,0 +1,118 @@
+#ifndef FDM_BATCH_H
+#define FDM_BATCH_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FDM_engines.h"
+#include "FDM_cache.h"
+
+/**
+ * Scratch state owned by one worker thread and reused for every contract it prices:
+ * the SOR workspace and the last implicit / CN factorizations (rebuilt only when w changes).
+ */
+struct FDM_worker_state {
+  FDM_workspace ws;
+  FDM_tridiag_factor implicit_op;
+  FDM_tridiag_factor cn_op;
+
+  FDM_worker_state() {}
+  ~FDM_worker_state();
+  FDM_worker_state(const FDM_worker_state &) = delete;
+  FDM_worker_state &operator=(const FDM_worker_state &) = delete;
+};
+
+double price_contract(const FDM_contract &c, double dx, double dtau, FDM_worker_state *state);
+void greeks_contract(const FDM_contract &c, double dx, double dtau, FDM_worker_state *state, FDM_result *res);
+bool parse_contract(const std::string &line, FDM_contract *c, double *price = 0);
+bool valid_grid(double dx, double dtau, long max_nodes);
+
+/**
+ * Fixed set of worker threads that stay alive between runs.
+ * run(n, task) calls task(i, worker) once for every i in [0,n) and returns when all are done.
+ * The indices are dealt out in contiguous blocks to one deque per worker; a worker takes from
+ * the back of its own deque and, once it is empty, steals from the front of the others.
+ * Calls of run from several threads are served one after the other; a task must not call run.
+ * An exception thrown by a task is rethrown by run once every task has finished.
+ */
+class FDM_thread_pool {
+public:
+  explicit FDM_thread_pool(int n_threads = 0); // 0 uses every hardware thread
+  ~FDM_thread_pool();
+
+  int size() const { return (int)threads.size(); }
+  void run(int n, const std::function<void(int, int)> &task);
+
+private:
+  struct task_queue {
+    std::mutex lock;
+    std::deque<int> tasks;
+  };
+
+  void worker_loop(int worker);
+  bool next_task(int worker, int *task);
+
+  std::vector<std::thread> threads;
+  std::vector<task_queue> queues;
+  std::mutex run_lock;          // held by the caller of run for the whole run
+  std::mutex lock;
+  std::condition_variable start_cv, done_cv;
+  const std::function<void(int, int)> *current = 0;
+  std::exception_ptr error;     // first exception thrown by a task of the current run
+  long generation = 0;
+  int remaining = 0;
+  int active = 0;
+  bool stopping = false;
+};
+
+// timing of the last batch priced
+struct FDM_batch_stats {
+  int n_options = 0;
+  int n_threads = 0;
+  double seconds = 0.0;
+  double options_per_second = 0.0;
+};
+
+/**
+ * Prices lists of contracts on a thread pool with one FDM_worker_state per thread.
+ * Results are written in input order. The pool and the worker states are kept between calls.
+ * With set_precision(PRECISION_MIXED, tol) price() marches the implicit and CN contracts in
+ * lane packs of similar sigma^2*T with float solves (see FDM_options), each within about tol of
+ * its double price; the other methods are priced as before.
+ * With set_cache(cache) price() in PRECISION_DOUBLE reads every contract from the final layer
+ * cached for its (r, q, sigma, T, dx, dtau, type, style, method), solving only on a miss.
+ * With set_surfaces(file) it first looks the contract up in a mapped surface file.
+ */
+class FDM_batch_pricer {
+public:
+  explicit FDM_batch_pricer(int n_threads = 0);
+
+  int threads() const { return pool.size(); }
+  void set_precision(FDM_precision mode, double tol) { precision = mode; precision_tol = tol; }
+  void set_cache(FDM_surface_cache *surfaces) { cache = surfaces; } // kept by the caller, 0 for none
+  void set_surfaces(const FDM_surface_file *file) { surfaces = file; } // kept open by the caller, 0 for none
+  void warm_up(double dx, double dtau); // every worker state ready for implicit and CN on the grid
+  void price(int n, const FDM_contract *contracts, double dx, double dtau, double *values, FDM_batch_stats *stats = 0);
+  void price_greeks(int n, const FDM_contract *contracts, double dx, double dtau, FDM_result *results, FDM_batch_stats *stats = 0);
+  void price_to_tolerance(int n, const FDM_contract *contracts, double tol, long max_nodes, double *values, FDM_adaptive_result *details = 0, FDM_batch_stats *stats = 0);
+  void implied_vols(int n, const FDM_contract *quotes, const double *prices, double dx, double dtau, double *vols, FDM_implied_result *details = 0, FDM_batch_stats *stats = 0);
+
+private:
+  void price_mixed(int n, const FDM_contract *contracts, double dx, double dtau, double *values);
+
+  FDM_thread_pool pool;
+  std::vector<FDM_worker_state> states;
+  FDM_precision precision = PRECISION_DOUBLE;
+  double precision_tol = 1e-5;
+  FDM_surface_cache *cache = 0;
+  const FDM_surface_file *surfaces = 0;
+};
+
+int batch_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,345 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Benchmarks every engine over a matrix of grids and contracts and reports accuracy against time,
+*              with the Pareto front of error versus nanoseconds per option.
+*
+* To compile & run (make bench):
+* g++ -O2 -pthread FDM_bench.cpp ImplicitFDM.cpp ExplicitFDM.cpp CN_FDM.cpp \
+* ImplicitSORFDM.cpp CN_SORFDM.cpp FDM_theta.cpp FDM_utils.cpp FDM_partition.cpp \
+* FDM_parareal.cpp BlackScholesFormula.cpp FDM_adaptive.cpp FDM_profile.cpp -o FDM_bench
+* ./FDM_bench [--reps n] [--quick] [--error ref|bs] [--csv file] [--json file] [--tridiag] [--parareal]
+*
+* */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "FDM_engines.h"
+
+using namespace std;
+
+/**
+ * One contract of the sweep with its reference values. The contracts are European: the early
+ * exercise value the engines compare against is scaled by w = dtau/dx^2, so an American price
+ * has no limit independent of the grid to measure an error against.
+ */
+struct bench_scenario {
+  double S, K, r, q, sigma, expiry;
+  int call_or_put;
+  double black_scholes;  // closed form
+  double reference;      // grid limit, Richardson extrapolated ImplicitFDM
+};
+
+// one engine on one grid
+struct bench_point {
+  string engine;
+  double dx, dtau;
+  int M;
+  double ns_per_option = 0.0;  // mean over the scenarios of the median call time
+  double rms_error = 0.0;
+  double max_error = 0.0;
+  int pareto = 0;
+};
+
+// engine variants of the sweep: the five engines, the tolerance driven SOR and the sinh grid
+enum bench_variant {
+  VARIANT_PLAIN = 0,
+  VARIANT_PSOR,
+  VARIANT_SINH
+};
+
+struct bench_engine {
+  const char *name;
+  FDM_engine engine;
+  bench_variant variant;
+  int explicit_scheme;  // 1 if stable only for w <= 0.5
+};
+
+static const bench_engine engines[] = {
+  {"explicit", ExplicitFDM, VARIANT_PLAIN, 1},
+  {"implicit", ImplicitFDM, VARIANT_PLAIN, 0},
+  {"cn", CN_FDM, VARIANT_PLAIN, 0},
+  {"implicit_sor", ImplicitSORFDM, VARIANT_PLAIN, 0},
+  {"cn_sor", CN_SORFDM, VARIANT_PLAIN, 0},
+  {"implicit_psor", ImplicitSORFDM, VARIANT_PSOR, 0},
+  {"cn_psor", CN_SORFDM, VARIANT_PSOR, 0},
+  {"implicit_sinh", ImplicitFDM, VARIANT_SINH, 0},
+  {"cn_sinh", CN_FDM, VARIANT_SINH, 0},
+};
+
+/**
+ * Prices every scenario with one engine on one grid, timing each call
+ *   Each scenario is priced once to warm up, then reps times; the median time is kept.
+ *   A sinh grid clustered at the strike uses half the nodes of the uniform grid of dx.
+ */
+static void run_point(const bench_engine &e, double dx, double dtau, int reps, vector<bench_scenario> &scenarios, bench_point *p, vector<double> *values, vector<double> *times) {
+  FDM_options opts;
+  FDM_sor_control sor;
+  vector<double> grid, samples(reps);
+  int k, rep, M = 1 + ((2.5 - (-2.5))/dx);
+  double value = 0.0;
+
+  if(e.variant == VARIANT_PSOR) opts.sor = &sor;
+  if(e.variant == VARIANT_SINH) {
+    M = M/2 + 1;
+    grid.resize(M);
+    sinh_grid(M, -2.5, 2.5, 0.0, 0.1, grid.data());
+    opts.n_grid = M;
+    opts.grid = grid.data();
+  }
+
+  p->engine = e.name;
+  p->dx = dx;
+  p->dtau = dtau;
+  p->M = M;
+
+  for(k=0; k<(int)scenarios.size(); k++) {
+    const bench_scenario &s = scenarios[k];
+
+    value = e.engine(s.S, s.K, s.r, s.q, s.sigma, s.expiry, dx, dtau, s.call_or_put, 0, &opts);
+    for(rep=0; rep<reps; rep++) {
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      value = e.engine(s.S, s.K, s.r, s.q, s.sigma, s.expiry, dx, dtau, s.call_or_put, 0, &opts);
+      samples[rep] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    }
+    nth_element(samples.begin(), samples.begin() + reps/2, samples.end());
+    (*values)[k] = value;
+    (*times)[k] = samples[reps/2];
+  }
+}
+
+// error of a price against the closed form or the grid limit
+static double scenario_error(const bench_scenario &s, double value, int use_bs) {
+  return fabs(value - (use_bs ? s.black_scholes : s.reference));
+}
+
+// marks the points that no other point beats in both time and error
+static void mark_pareto(vector<bench_point> &points) {
+  size_t i, j;
+
+  for(i=0; i<points.size(); i++) {
+    points[i].pareto = 1;
+    for(j=0; j<points.size(); j++) {
+      if(points[j].ns_per_option <= points[i].ns_per_option && points[j].rms_error <= points[i].rms_error &&
+         (points[j].ns_per_option < points[i].ns_per_option || points[j].rms_error < points[i].rms_error)) {
+        points[i].pareto = 0;
+        break;
+      }
+    }
+  }
+}
+
+// median time in ns of reps calls of solve
+template<class F> static double median_ns(int reps, F solve) {
+  vector<double> samples(reps);
+  int rep;
+
+  solve();
+  for(rep=0; rep<reps; rep++) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    solve();
+    samples[rep] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+  }
+  nth_element(samples.begin(), samples.begin() + reps/2, samples.end());
+  return samples[reps/2];
+}
+
+/**
+ * Times one solve of the Crank-Nicholson matrix (w = 2) with the serial Thomas factorization
+ * and with the partitioned one, on one thread and on every hardware thread, for n = 1024 ...
+ * 262144, and reports the smallest n from which a partitioned solve stays faster
+ */
+static void tridiag_sweep(int reps) {
+  int n, threads = partition_threads(0), crossover = 0;
+
+  cout << "tridiagonal solve of the CN matrix, " << threads << " hardware threads, ns per solve:" << endl;
+  cout << right << setw(8) << "n" << setw(12) << "thomas" << setw(14) << "partition 1" << setw(14) << "partition all"
+       << setw(10) << "speedup" << setw(12) << "max diff" << endl;
+  for(n=1024; n<=262144; n*=2) {
+    vector<double> a(3*n), lw(n, 2.0), b(n), x(n), y(n);
+    FDM_tridiag_factor serial;
+    FDM_partition_factor single, team;
+    double t_serial, t_single, t_team, diff = 0.0;
+    int i;
+
+    heat_operator_matrix(n, lw.data(), lw.data(), 0.5, a.data());
+    for(i=0; i<n; i++) {
+      b[i] = sin(0.01*i) + 1.0;
+    }
+    tridiag_factor(n, a.data(), &serial);
+    partition_factor(n, a.data(), 1, &single);
+    partition_factor(n, a.data(), threads, &team);
+
+    t_serial = median_ns(reps, [&]() { tridiag_solve(&serial, b.data(), x.data()); });
+    t_single = median_ns(reps, [&]() { partition_solve(&single, b.data(), y.data()); });
+    t_team = median_ns(reps, [&]() { partition_solve(&team, b.data(), y.data()); });
+    for(i=0; i<n; i++) {
+      diff = max(diff, fabs(x[i] - y[i]));
+    }
+    if(min(t_single, t_team) >= t_serial) crossover = 0;
+    else if(crossover == 0) crossover = n;
+
+    cout << setw(8) << n << fixed << setprecision(0) << setw(12) << t_serial << setw(14) << t_single << setw(14) << t_team
+         << setprecision(2) << setw(10) << t_serial/min(t_single, t_team) << scientific << setw(12) << diff
+         << defaultfloat << setprecision(6) << endl;
+
+    tridiag_factor_free(&serial);
+    partition_factor_free(&single);
+    partition_factor_free(&team);
+  }
+  if(crossover > 0) cout << "partitioned solve faster from n = " << crossover << " (engines switch at " << FDM_PARTITION_MIN_N << ")" << endl;
+  else cout << "partitioned solve never faster (engines switch at " << FDM_PARTITION_MIN_N << ")" << endl;
+}
+
+/**
+ * Prices a long dated put (T = 10, sigma = 0.3, dx = 0.02, dtau = 1e-5, 45000 steps) with the
+ * serial Crank-Nicholson march and with parareal_fdm on every hardware thread for a range of
+ * slice counts, reporting iterations, the measured speedup and the speedup the critical path
+ * allows with a thread per slice
+ */
+static void parareal_sweep(int reps) {
+  FDM_theta_scheme cn = {0.5, STEP_FACTORED, 0, 0};
+  FDM_options opts;
+  double S = 100.0, K = 100.0, r = 0.05, q = 0.02, sigma = 0.3, expiry = 10.0, dx = 0.02, dtau = 1e-5;
+  double serial = 0.0, value = 0.0, t_serial, t_parallel;
+  int threads = partition_threads(0);
+
+  opts.rannacher_steps = 2;
+  t_serial = median_ns(reps, [&]() { serial = theta_fdm(cn, S, K, r, q, sigma, expiry, dx, dtau, -1, 0, &opts); });
+
+  cout << "Parareal, CN put T=" << expiry << " N=" << (int)(1 + 0.5*sigma*sigma*expiry/dtau) << " on " << threads
+       << " hardware threads, serial march " << fixed << setprecision(1) << t_serial*1e-6 << " ms" << endl;
+  cout << right << setw(8) << "slices" << setw(12) << "iterations" << setw(12) << "ms" << setw(12) << "speedup"
+       << setw(14) << "model speedup" << setw(12) << "price diff" << endl;
+  for(int slices : {2, 4, 8, 16, 32, 64}) {
+    FDM_parareal_control ctl;
+
+    ctl.slices = slices;
+    t_parallel = median_ns(reps, [&]() { value = parareal_fdm(0.5, S, K, r, q, sigma, expiry, dx, dtau, -1, 0, &opts, &ctl); });
+    cout << setw(8) << slices << setw(12) << ctl.iterations << fixed << setprecision(1) << setw(12) << t_parallel*1e-6
+         << setprecision(2) << setw(12) << t_serial/t_parallel << setw(14) << ctl.model_speedup
+         << scientific << setw(12) << fabs(value - serial) << defaultfloat << setprecision(6) << endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *csv_path = 0, *json_path = 0;
+  int k, reps = 3, quick = 0, use_bs = 0, tridiag = 0, parareal = 0, levels, level, wi;
+  double moneyness[] = {0.9, 1.0, 1.1};
+  double vols[] = {0.2, 0.4};
+  double expiries[] = {0.25, 1.0};
+  double ws[] = {0.4, 2.0};  // w = dtau/dx^2; the explicit scheme is only run at the stable 0.4
+  vector<bench_scenario> scenarios;
+  vector<bench_point> points;
+
+  for(k=1; k<argc; k++) {
+    if(strcmp(argv[k], "--reps") == 0 && k+1 < argc) reps = max(1, atoi(argv[++k]));
+    else if(strcmp(argv[k], "--quick") == 0) quick = 1;
+    else if(strcmp(argv[k], "--error") == 0 && k+1 < argc) use_bs = (strcmp(argv[++k], "bs") == 0);
+    else if(strcmp(argv[k], "--csv") == 0 && k+1 < argc) csv_path = argv[++k];
+    else if(strcmp(argv[k], "--json") == 0 && k+1 < argc) json_path = argv[++k];
+    else if(strcmp(argv[k], "--tridiag") == 0) tridiag = 1;
+    else if(strcmp(argv[k], "--parareal") == 0) parareal = 1;
+    else {
+      cerr << "usage: FDM_bench [--reps n] [--quick] [--error ref|bs] [--csv file] [--json file] [--tridiag] [--parareal]" << endl;
+      return 1;
+    }
+  }
+  if(tridiag) {
+    tridiag_sweep(max(reps, 21));
+    return 0;
+  }
+  if(parareal) {
+    parareal_sweep(reps);
+    return 0;
+  }
+  levels = quick ? 2 : 4;
+
+  // K = 100, r = 0.05, q = 0.02, calls and puts. The reference spends 3e7 grid nodes on
+  // refinement, its extrapolated value agrees with that of CN_FDM to about 1e-7
+  for(double m : moneyness) for(double sigma : vols) for(double expiry : expiries) {
+    for(int cp = 1; cp >= -1; cp -= 2) {
+      bench_scenario s = {100.0*m, 100.0, 0.05, 0.02, sigma, expiry, cp, 0.0, 0.0};
+      s.black_scholes = (cp > 0) ? BlackScholesCall(s.S, s.K, s.r, s.q, s.sigma, s.expiry)
+                                 : BlackScholesPut(s.S, s.K, s.r, s.q, s.sigma, s.expiry);
+      s.reference = price_to_tolerance(ImplicitFDM, s.S, s.K, s.r, s.q, s.sigma, s.expiry, cp, 0, 1e-9, 30000000L);
+      scenarios.push_back(s);
+    }
+  }
+
+  ofstream csv;
+  if(csv_path != 0) {
+    csv.open(csv_path);
+    csv << "engine,dx,dtau,M,S,K,r,q,sigma,T,type,value,black_scholes,reference,bs_error,ref_error,ns" << endl;
+  }
+
+  vector<double> values(scenarios.size()), times(scenarios.size());
+  for(const bench_engine &e : engines) {
+    for(level=0; level<levels; level++) {
+      for(wi=0; wi<2; wi++) {
+        double dx = 0.1/(1 << level), dtau = ws[wi]*dx*dx;
+        bench_point p;
+        double square_sum = 0.0, err;
+
+        if(e.explicit_scheme && ws[wi] > 0.5) continue;
+
+        run_point(e, dx, dtau, reps, scenarios, &p, &values, &times);
+        for(k=0; k<(int)scenarios.size(); k++) {
+          const bench_scenario &s = scenarios[k];
+
+          err = scenario_error(s, values[k], use_bs);
+          square_sum += err*err;
+          p.max_error = max(p.max_error, err);
+          p.ns_per_option += times[k]/scenarios.size();
+          if(csv_path != 0) {
+            csv << e.name << ',' << dx << ',' << dtau << ',' << p.M << ',' << s.S << ',' << s.K << ',' << s.r << ',' << s.q << ','
+                << s.sigma << ',' << s.expiry << ',' << ((s.call_or_put > 0) ? "call" : "put") << ','
+                << setprecision(10) << values[k] << ',' << s.black_scholes << ',' << s.reference << ','
+                << fabs(values[k] - s.black_scholes) << ',' << fabs(values[k] - s.reference) << ','
+                << setprecision(6) << times[k] << endl;
+          }
+        }
+        p.rms_error = sqrt(square_sum/scenarios.size());
+        points.push_back(p);
+        cerr << '.' << flush;
+      }
+    }
+  }
+  cerr << endl;
+
+  mark_pareto(points);
+  sort(points.begin(), points.end(), [](const bench_point &a, const bench_point &b) { return a.ns_per_option < b.ns_per_option; });
+
+  cout << scenarios.size() << " European contracts per point, error against " << (use_bs ? "Black-Scholes" : "the grid limit") << endl;
+  cout << "Pareto front of rms error versus time:" << endl;
+  cout << left << setw(16) << "engine" << right << setw(9) << "dx" << setw(11) << "dtau" << setw(6) << "M"
+       << setw(14) << "ns/option" << setw(12) << "rms error" << setw(12) << "max error" << endl;
+  for(const bench_point &p : points) {
+    if(!p.pareto) continue;
+    cout << left << setw(16) << p.engine << right << setw(9) << p.dx << setw(11) << p.dtau << setw(6) << p.M
+         << fixed << setprecision(0) << setw(14) << p.ns_per_option << scientific << setprecision(2)
+         << setw(12) << p.rms_error << setw(12) << p.max_error << defaultfloat << setprecision(6) << endl;
+  }
+
+  if(json_path != 0) {
+    ofstream json(json_path);
+    json << "{\n  \"contracts\": " << scenarios.size() << ",\n  \"error\": \"" << (use_bs ? "bs" : "ref") << "\",\n  \"points\": [\n";
+    for(size_t i=0; i<points.size(); i++) {
+      const bench_point &p = points[i];
+      json << "    {\"engine\": \"" << p.engine << "\", \"dx\": " << p.dx << ", \"dtau\": " << p.dtau << ", \"M\": " << p.M
+           << ", \"ns_per_option\": " << setprecision(10) << p.ns_per_option << ", \"rms_error\": " << p.rms_error
+           << ", \"max_error\": " << p.max_error << ", \"pareto\": " << (p.pareto ? "true" : "false") << "}"
+           << (i+1 < points.size() ? "," : "") << "\n" << setprecision(6);
+    }
+    json << "  ]\n}\n";
+  }
+  return 0;
+}
@@ -0,0 +1,134 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: size-bounded LRU cache of the final solution layers of the engines, shared by the options of a chain.
+*
+* */
+
+#include "FDM_cache.h"
+#include <cmath>
+#include <functional>
+
+using namespace std;
+
+size_t FDM_surface_key_hash::operator()(const FDM_surface_key &k) const {
+  hash<double> h;
+  size_t seed = 0;
+  double fields[6] = {k.r, k.q, k.sigma, k.expiry, k.dx, k.dtau};
+
+  for(int i=0; i<6; i++) {
+    seed ^= h(fields[i]) + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+  }
+  return seed ^ (size_t)(k.call_or_put + 2) ^ ((size_t)k.amer_or_eur << 2) ^ ((size_t)k.method << 3);
+}
+
+FDM_surface_cache::FDM_surface_cache(size_t max_bytes) : max_bytes(max_bytes) {
+}
+
+// bytes a surface holds against the bound of the cache
+static size_t surface_bytes(const FDM_surface &s) {
+  return sizeof(FDM_surface) + (s.x.size() + s.y.size())*sizeof(double);
+}
+
+/**
+ * Final layer of the march of contract c, from the cache or solved and inserted
+ *   The layer is captured as the snapshot of the last whole step, N-1 with N as in the engines,
+ *   and its scale exp(alpha*x + beta*tau) is the one the engine reports in FDM_result.
+ * Inputs: FDM_contract c (S and K only pass through to the engine), double dx, dtau (grid)
+ *         const FDM_options *opts (optional), workspace, factorization and solver_threads
+ * Output: shared reference to the layer, null for METHOD_BLACK_SCHOLES
+ */
+shared_ptr<const FDM_surface> FDM_surface_cache::surface(const FDM_contract &c, double dx, double dtau, const FDM_options *opts) {
+  FDM_surface_key key = {c.r, c.q, c.sigma, c.expiry, dx, dtau, c.call_or_put, c.amer_or_eur, c.method};
+  FDM_engine engine = engine_for_method(c.method);
+
+  if(engine == 0) return 0;
+
+  {
+    lock_guard<mutex> guard(lock);
+    auto found = index.find(key);
+    if(found != index.end()) {
+      lru.splice(lru.begin(), lru, found->second);
+      counts.hits++;
+      return found->second->second;
+    }
+    counts.misses++;
+  }
+
+  // solve outside the lock
+  shared_ptr<FDM_surface> s = make_shared<FDM_surface>();
+  FDM_options solve;
+  FDM_result res;
+  int i, last = (int)(1 + ((0.5*(c.sigma*c.sigma)*c.expiry - 0.0)/dtau)) - 1;
+
+  s->M = 1 + ((2.5 - (-2.5))/dx);
+  s->x.resize(s->M);
+  s->y.assign(s->M, NAN);
+  for(i=0; i<s->M; i++) {
+    s->x[i] = -2.5 + i*dx;
+  }
+  if(opts != 0) {
+    solve.workspace = opts->workspace;
+    solve.factor = opts->factor;
+    solve.solver_threads = opts->solver_threads;
+  }
+  solve.n_snapshots = 1;
+  solve.snapshot_layers = &last;
+  solve.snapshots = s->y.data();
+  solve.result = &res;
+  engine(c.S, c.K, c.r, c.q, c.sigma, c.expiry, dx, dtau, c.call_or_put, c.amer_or_eur, &solve);
+  // the scale of the layer as the engine applies it
+  s->alpha = res.alpha;
+  s->beta_tau = res.beta_tau;
+
+  lock_guard<mutex> guard(lock);
+  if(index.find(key) == index.end() && surface_bytes(*s) <= max_bytes) {
+    lru.push_front(make_pair(key, shared_ptr<const FDM_surface>(s)));
+    index[key] = lru.begin();
+    counts.entries++;
+    counts.bytes += surface_bytes(*s);
+    while(counts.bytes > max_bytes) {
+      counts.bytes -= surface_bytes(*lru.back().second);
+      index.erase(lru.back().first);
+      lru.pop_back();
+      counts.entries--;
+      counts.evictions++;
+    }
+  }
+  return s;
+}
+
+/**
+ * Price of contract c read from its cached layer (see surface)
+ * Inputs: as surface
+ * Output: double value (value of option)
+ */
+double FDM_surface_cache::price(const FDM_contract &c, double dx, double dtau, const FDM_options *opts) {
+  shared_ptr<const FDM_surface> s = surface(c, dx, dtau, opts);
+
+  if(s == 0) {
+    return (c.call_or_put > 0) ? BlackScholesCall(c.S, c.K, c.r, c.q, c.sigma, c.expiry)
+                               : BlackScholesPut(c.S, c.K, c.r, c.q, c.sigma, c.expiry);
+  }
+  return value_at_spot(c.S, c.K, s->alpha, s->beta_tau, s->M, s->x.data(), s->y.data());
+}
+
+// every cached layer with its key, most recently used first, e.g. for write_surface_file
+vector<pair<FDM_surface_key, shared_ptr<const FDM_surface> > > FDM_surface_cache::contents() const {
+  lock_guard<mutex> guard(lock);
+  return vector<pair<FDM_surface_key, shared_ptr<const FDM_surface> > >(lru.begin(), lru.end());
+}
+
+FDM_cache_stats FDM_surface_cache::stats() const {
+  lock_guard<mutex> guard(lock);
+  return counts;
+}
+
+// drops every layer; the hit and miss counts are kept
+void FDM_surface_cache::clear() {
+  lock_guard<mutex> guard(lock);
+  lru.clear();
+  index.clear();
+  counts.entries = 0;
+  counts.bytes = 0;
+}
@@ -0,0 +1,137 @@
+#ifndef FDM_CACHE_H
+#define FDM_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "FDM_engines.h"
+
+// parameters that fix the final layer of a march; S and K only pick the point read from it
+struct FDM_surface_key {
+  double r, q, sigma, expiry, dx, dtau;
+  int call_or_put;
+  int amer_or_eur;
+  FDM_method method;
+
+  bool operator==(const FDM_surface_key &o) const {
+    return r == o.r && q == o.q && sigma == o.sigma && expiry == o.expiry && dx == o.dx && dtau == o.dtau &&
+           call_or_put == o.call_or_put && amer_or_eur == o.amer_or_eur && method == o.method;
+  }
+};
+
+struct FDM_surface_key_hash {
+  size_t operator()(const FDM_surface_key &k) const;
+};
+
+// final layer of one march on the uniform grid, priced at any S/K by value_at_spot
+struct FDM_surface {
+  int M = 0;
+  double alpha = 0.0;
+  double beta_tau = 0.0;       // beta times the tau of the final layer
+  std::vector<double> x;       // grid, x = log(S/K)
+  std::vector<double> y;       // final layer
+};
+
+struct FDM_cache_stats {
+  long hits = 0;
+  long misses = 0;             // lookups that solved the PDE
+  long evictions = 0;
+  long entries = 0;
+  size_t bytes = 0;            // layers and grids held
+};
+
+/**
+ * Size-bounded LRU cache of final solution layers, keyed on (r, q, sigma, T, dx, dtau, type,
+ * style, method). The transformed solution does not depend on K, so one layer prices every
+ * S/K of a chain: a hit costs the cubic interpolation of value_at_spot instead of a march.
+ * Thread safe; lookups interpolate outside the lock on a shared reference to the layer, and
+ * two threads missing the same key at once both solve it, the second insert being dropped.
+ * The marches run on the uniform grid with the default engine settings; opts may only supply
+ * the workspace, the factorization and solver_threads. METHOD_BLACK_SCHOLES is not cached.
+ */
+class FDM_surface_cache {
+public:
+  explicit FDM_surface_cache(size_t max_bytes = 64 << 20);
+
+  double price(const FDM_contract &c, double dx, double dtau, const FDM_options *opts = 0);
+  std::shared_ptr<const FDM_surface> surface(const FDM_contract &c, double dx, double dtau, const FDM_options *opts = 0);
+  std::vector<std::pair<FDM_surface_key, std::shared_ptr<const FDM_surface> > > contents() const;
+  FDM_cache_stats stats() const;
+  void clear();
+
+private:
+  typedef std::list<std::pair<FDM_surface_key, std::shared_ptr<const FDM_surface> > > lru_list;
+
+  size_t max_bytes;
+  mutable std::mutex lock;
+  lru_list lru;                // most recently used first
+  std::unordered_map<FDM_surface_key, lru_list::iterator, FDM_surface_key_hash> index;
+  FDM_cache_stats counts;
+};
+
+/**
+ * Binary file of final layers, written after a run and mapped read-only by the pricing service:
+ *   header          64 bytes, FDM_surface_file_header
+ *   index           n_entries FDM_surface_file_entry of 96 bytes, sorted by key for binary search
+ *   data            per entry the grid x and the layer y, M doubles each, every array 64-byte aligned
+ * Numbers are in the byte order of the writer; a reader of the other order, another version or a
+ * size that does not match the header rejects the file.
+ */
+#define FDM_SURFACE_FILE_VERSION 1
+#define FDM_SURFACE_FILE_ALIGN 64
+
+struct FDM_surface_file_header {
+  char magic[8];                // "FDMSURF"
+  uint32_t version;             // FDM_SURFACE_FILE_VERSION
+  uint32_t byte_order;          // 0x01020304 as written
+  uint64_t n_entries;
+  uint64_t index_offset;        // from the start of the file
+  uint64_t file_size;
+  uint8_t reserved[24];
+};
+
+struct FDM_surface_file_entry {
+  double r, q, sigma, expiry, dx, dtau;
+  int32_t call_or_put, amer_or_eur, method, M;
+  double alpha, beta_tau;
+  uint64_t x_offset, y_offset;  // from the start of the file
+};
+
+static_assert(sizeof(FDM_surface_file_header) == 64, "surface file header must stay 64 bytes");
+static_assert(sizeof(FDM_surface_file_entry) == 96, "surface file entry must stay 96 bytes");
+
+// writes the layers to path, false when the file cannot be written
+bool write_surface_file(const char *path, const std::vector<std::pair<FDM_surface_key, std::shared_ptr<const FDM_surface> > > &surfaces);
+
+/**
+ * A surface file mapped read-only (mmap, or read into memory where there is none). Lookups
+ * binary search the mapped index and interpolate straight from the mapped layer, nothing is
+ * copied; the object may be shared by threads once open.
+ */
+class FDM_surface_file {
+public:
+  FDM_surface_file() {}
+  ~FDM_surface_file() { close(); }
+  FDM_surface_file(const FDM_surface_file &) = delete;
+  FDM_surface_file &operator=(const FDM_surface_file &) = delete;
+
+  bool open(const char *path);  // false if missing, truncated, of another version or byte order
+  void close();
+  long size() const { return (header != 0) ? (long)header->n_entries : 0; }
+  const FDM_surface_file_entry *find(const FDM_surface_key &key) const;
+  bool price(const FDM_contract &c, double dx, double dtau, double *value) const; // false when not in the file
+
+private:
+  const char *data = 0;
+  size_t bytes = 0;
+  int mapped = 0;
+  std::vector<char> buffer;     // file contents where there is no mmap
+  const FDM_surface_file_header *header = 0;
+  const FDM_surface_file_entry *entries = 0;
+};
+
+#endif
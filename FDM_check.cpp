@@ -0,0 +1,401 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Regression check of the engines against values stored before the theta scheme refactor, and of the claims
+*              the faster paths make: mixed precision packs within precision_tol, no allocation per time step.
+*
+* To compile & run (make check):
+* g++ -O2 -pthread FDM_check.cpp ImplicitFDM.cpp ExplicitFDM.cpp CN_FDM.cpp \
+* ImplicitSORFDM.cpp CN_SORFDM.cpp FDM_theta.cpp FDM_utils.cpp FDM_partition.cpp \
+* BlackScholesFormula.cpp FDM_pack.cpp FDM_parareal.cpp FDM_adaptive.cpp FDM_profile.cpp -o FDM_check
+* ./FDM_check
+*
+* */
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include "FDM_engines.h"
+#include "FDM_utils.h"
+
+using namespace std;
+
+#define CHECK_TOL 1e-12   // relative, the refactored explicit step moved its results by a few ulps
+#define CHECK_SOR_TOL 1e-4  // absolute, an SOR engine against the direct engine of the same theta
+#define CHECK_LCP_TOL 1e-3  // absolute, psor_method against Brennan-Schwartz for Americans
+
+// operator new calls of the whole program, for the allocation checks
+static atomic<long> allocations(0);
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size > 0 ? size : 1);
+  if(p == 0) throw bad_alloc();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+// out of line, or gcc pairs the inlined free with operator new and warns of a mismatch
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete[](p); }
+
+enum check_variant {
+  CHECK_UNIFORM,                // default settings, the SOR engines with their fixed sweeps
+  CHECK_PSOR,                   // SOR engines with a control block, psor_method to tolerance
+  CHECK_BRENNAN_SCHWARTZ,       // AMERICAN_BRENNAN_SCHWARTZ
+  CHECK_GRID,                   // sinh grid of 101 nodes clustered at the strike
+  CHECK_GRID_BRENNAN_SCHWARTZ
+};
+
+struct check_reference {
+  const char *engine;
+  check_variant variant;
+  int call_or_put, amer_or_eur;
+  double price, delta, gamma, theta;
+};
+
+/**
+ * S=95, K=100, r=0.05, q=0.02, sigma=0.25, T=0.75 on dx=0.05, dtau=0.00125, as priced by the
+ * theta scheme march (FDM_theta.cpp) once exp(beta*tau) carried the discount with its sign and the
+ * early exercise value was the payoff itself
+ */
+static const check_reference references[] = {
+  {"explicit", CHECK_UNIFORM, 1, 0, 6.7977294851029262, 0.48137131424242019, 0.00060410544695588394, -12.025159993456947},
+  {"explicit", CHECK_UNIFORM, 1, 1, 6.7977294851029262, 0.48137131424242019, 0.00060410544695588394, -12.025159993456947},
+  {"explicit", CHECK_UNIFORM, -1, 0, 9.6207666864666272, -0.50473409738169117, 0.00060626741833195638, -9.0718260867144362},
+  {"explicit", CHECK_UNIFORM, -1, 1, 9.9569205822649067, -0.53348020510365446, 0.0075342747386813545, -8.1368470000351127},
+  {"implicit", CHECK_UNIFORM, 1, 0, 6.5969338268406528, 0.47766175649825748, 0.019996625144539735, -6.6848554970161969},
+  {"implicit", CHECK_UNIFORM, 1, 1, 6.596934214371772, 0.47766183346233421, 0.019996637046724674, -6.6848590609190142},
+  {"implicit", CHECK_UNIFORM, -1, 0, 9.4175408255101569, -0.50846924687153316, 0.019998787172024007, -3.7281922171087682},
+  {"implicit", CHECK_UNIFORM, -1, 1, 9.7057636120698252, -0.5336214455900119, 0.022038924932908634, -4.2184744030095169},
+  {"implicit", CHECK_GRID, 1, 0, 6.6459115819197301, 0.47716329266041568, 0.019868507057649885, -6.6433594793710595},
+  {"implicit", CHECK_GRID, 1, 1, 6.645911920389489, 0.47716335544305283, 0.019868517739280278, -6.6433626545050153},
+  {"implicit", CHECK_GRID, -1, 0, 9.4670016361160076, -0.50860685628148816, 0.019867909770611546, -3.6872136511313229},
+  {"implicit", CHECK_GRID, -1, 1, 9.7578627623231853, -0.5336521683344706, 0.021912012813214143, -4.1790497821534514},
+  {"cn", CHECK_UNIFORM, 1, 0, 6.6443705379407589, 0.48018574951494664, 0.019611495480415724, -6.6490701738519133},
+  {"cn", CHECK_UNIFORM, 1, 1, 6.6443706031549246, 0.48018576663478013, 0.019611498715842723, -6.6490709293474461},
+  {"cn", CHECK_UNIFORM, -1, 0, 9.4661933753518515, -0.50593245021672117, 0.019613657479829329, -3.6940726011052654},
+  {"cn", CHECK_UNIFORM, -1, 1, 9.7818663709489009, -0.53256241710920482, 0.021674152973039595, -4.1824956550660621},
+  {"cn", CHECK_GRID, 1, 0, 6.6929166161410203, 0.47940374235422606, 0.018321035510434569, -6.6362153579192409},
+  {"cn", CHECK_GRID, 1, 1, 6.692916665550749, 0.47940375417559739, 0.018321038116099454, -6.6362159534818623},
+  {"cn", CHECK_GRID, -1, 0, 9.5152282535803803, -0.50635346991475105, 0.018320439316527336, -3.681743597663008},
+  {"cn", CHECK_GRID, -1, 1, 9.8355829519638274, -0.53267237483144003, 0.019930745263534923, -4.1728081120017881},
+  {"implicit_sor", CHECK_UNIFORM, 1, 0, 6.5969338216479159, 0.47766175643413683, 0.019996625144952554, -6.6848554819659025},
+  {"implicit_sor", CHECK_UNIFORM, 1, 1, 6.5969342140736282, 0.47766183345863505, 0.019996637046704485, -6.6848590604954641},
+  {"implicit_sor", CHECK_UNIFORM, -1, 0, 9.4175435462902595, -0.50846953428259889, 0.019998782307703383, -3.7281943186445137},
+  {"implicit_sor", CHECK_UNIFORM, -1, 1, 9.7057636056461778, -0.53362163176176003, 0.022038933293090614, -4.218480633676033},
+  {"implicit_sor", CHECK_PSOR, 1, 0, 6.5969338268406386, 0.47766175649825354, 0.019996625144540484, -6.6848554970160192},
+  {"implicit_sor", CHECK_PSOR, 1, 1, 6.5969343508485938, 0.47766185809118389, 0.019996640485774795, -6.68486010581565},
+  {"implicit_sor", CHECK_PSOR, -1, 0, 9.4175408244696754, -0.50846924669589511, 0.019998787145301226, -3.7281922045158638},
+  {"implicit_sor", CHECK_PSOR, -1, 1, 9.7303443120647852, -0.5349721064638282, 0.022093807449325046, -4.2288966523341101},
+  {"implicit_sor", CHECK_BRENNAN_SCHWARTZ, 1, 1, 6.5969343490127192, 0.47766185796197458, 0.019996640560055665, -6.6848601169977941},
+  {"implicit_sor", CHECK_BRENNAN_SCHWARTZ, -1, 1, 9.7303443102731748, -0.53497210624668479, 0.022093807466102657, -4.2288966380992301},
+  {"implicit_sor", CHECK_GRID, 1, 0, 6.6459113282654823, 0.47716328657300444, 0.019868509202372372, -6.6433596570019029},
+  {"implicit_sor", CHECK_GRID, 1, 1, 6.6459120566107375, 0.47716337736919301, 0.019868520056205419, -6.643363355630151},
+  {"implicit_sor", CHECK_GRID, -1, 0, 9.4670013984319681, -0.50860686026393764, 0.019867953042203654, -3.6872135744026551},
+  {"implicit_sor", CHECK_GRID, -1, 1, 9.7844182709328802, -0.535065225370979, 0.021961706131769749, -4.1877144314265005},
+  {"implicit_sor", CHECK_GRID_BRENNAN_SCHWARTZ, 1, 1, 6.6459120570134225, 0.47716337865969538, 0.019868521303456725, -6.6433637194531228},
+  {"implicit_sor", CHECK_GRID_BRENNAN_SCHWARTZ, -1, 1, 9.7844181754841859, -0.53506521537790097, 0.021961676388310064, -4.1877148250195253},
+  {"cn_sor", CHECK_UNIFORM, 1, 0, 6.6443705379309295, 0.48018574951379445, 0.019611495480699865, -6.6490701739193705},
+  {"cn_sor", CHECK_UNIFORM, 1, 1, 6.644370603156327, 0.48018576663497381, 0.019611498715795771, -6.649070929334612},
+  {"cn_sor", CHECK_UNIFORM, -1, 0, 9.4661898451277207, -0.50593224227185241, 0.019613691388706129, -3.6940611597235566},
+  {"cn_sor", CHECK_UNIFORM, -1, 1, 9.7818693867330673, -0.53256234083505027, 0.021674134785456198, -4.1824907886529674},
+  {"cn_sor", CHECK_PSOR, 1, 0, 6.6443705379407492, 0.48018574951494725, 0.019611495480416189, -6.6490701738518245},
+  {"cn_sor", CHECK_PSOR, 1, 1, 6.6443706196057057, 0.48018577038974825, 0.019611499418134188, -6.6490711059871268},
+  {"cn_sor", CHECK_PSOR, -1, 0, 9.4661933724611309, -0.50593244996874931, 0.019613657470672893, -3.6940725978075477},
+  {"cn_sor", CHECK_PSOR, -1, 1, 9.7961992880641215, -0.53323014641827715, 0.021700078105944279, -4.1852004577418525},
+  {"cn_sor", CHECK_BRENNAN_SCHWARTZ, 1, 1, 6.6443706201182673, 0.48018577060657791, 0.019611499405535433, -6.6490710984188253},
+  {"cn_sor", CHECK_BRENNAN_SCHWARTZ, -1, 1, 9.7961992820161168, -0.53323014620785902, 0.021700078177746569, -4.1852004599197103},
+  {"cn_sor", CHECK_GRID, 1, 0, 6.6929165040661989, 0.4794037419913198, 0.018321035822939299, -6.6362154418835431},
+  {"cn_sor", CHECK_GRID, 1, 1, 6.6929165705515263, 0.47940375752856573, 0.018321039162905266, -6.6362162146377148},
+  {"cn_sor", CHECK_GRID, -1, 0, 9.5152281393083094, -0.50635347028457811, 0.018320439634044297, -3.6817436832868715},
+  {"cn_sor", CHECK_GRID, -1, 1, 9.8505687702297777, -0.53366875244023382, 0.020368432451261517, -4.1755020131105072},
+  {"cn_sor", CHECK_GRID_BRENNAN_SCHWARTZ, 1, 1, 6.6929166826263504, 0.47940375789147782, 0.018321038850414268, -6.6362161306733016},
+  {"cn_sor", CHECK_GRID_BRENNAN_SCHWARTZ, -1, 1, 9.8505680277578911, -0.53366877592930895, 0.020368503129397354, -4.1754935171872978},
+};
+
+static FDM_engine engine_by_name(const string &name) {
+  if(name == "explicit") return ExplicitFDM;
+  if(name == "implicit") return ImplicitFDM;
+  if(name == "cn") return CN_FDM;
+  if(name == "implicit_sor") return ImplicitSORFDM;
+  return CN_SORFDM;
+}
+
+static const char *variant_name(check_variant v) {
+  switch(v) {
+  case CHECK_UNIFORM: return "uniform";
+  case CHECK_PSOR: return "psor";
+  case CHECK_BRENNAN_SCHWARTZ: return "brennan_schwartz";
+  case CHECK_GRID: return "grid";
+  case CHECK_GRID_BRENNAN_SCHWARTZ: return "grid_brennan_schwartz";
+  }
+  return "";
+}
+
+static bool close_to(double value, double reference) {
+  return fabs(value - reference) <= CHECK_TOL*fmax(1.0, fabs(reference));
+}
+
+// every engine, variant, type and style against the stored values; returns the number of failures
+static int check_engines() {
+  vector<double> grid(101);
+  int failed = 0, n = sizeof(references)/sizeof(references[0]);
+  double worst = 0.0;
+
+  sinh_grid(101, -2.5, 2.5, 0.0, 0.1, grid.data());
+  for(int k=0; k<n; k++) {
+    const check_reference &c = references[k];
+    FDM_options opts;
+    FDM_result res;
+    FDM_sor_control sor;
+
+    opts.result = &res;
+    if(c.variant == CHECK_PSOR) opts.sor = &sor;
+    if(c.variant == CHECK_BRENNAN_SCHWARTZ || c.variant == CHECK_GRID_BRENNAN_SCHWARTZ) opts.american_solver = AMERICAN_BRENNAN_SCHWARTZ;
+    if(c.variant == CHECK_GRID || c.variant == CHECK_GRID_BRENNAN_SCHWARTZ) {
+      opts.grid = grid.data();
+      opts.n_grid = (int)grid.size();
+    }
+    double price = engine_by_name(c.engine)(95.0, 100.0, 0.05, 0.02, 0.25, 0.75, 0.05, 0.00125, c.call_or_put, c.amer_or_eur, &opts);
+    double got[4] = {price, res.delta, res.gamma, res.theta};
+    double want[4] = {c.price, c.delta, c.gamma, c.theta};
+
+    for(int i=0; i<4; i++) {
+      worst = fmax(worst, fabs(got[i] - want[i])/fmax(1.0, fabs(want[i])));
+      if(!close_to(got[i], want[i])) {
+        printf("FAIL %s %s %s %s: %s %.17g, expected %.17g\n", c.engine, variant_name(c.variant), (c.call_or_put > 0) ? "call" : "put",
+               c.amer_or_eur ? "american" : "european", (i == 0) ? "price" : (i == 1) ? "delta" : (i == 2) ? "gamma" : "theta", got[i], want[i]);
+        failed++;
+      }
+    }
+  }
+  printf("engines: %d cases, largest relative difference %.1e\n", n, worst);
+  return failed;
+}
+
+/**
+ * Bounds a price must keep whatever the stored values say, on the uniform grid and on a sinh grid:
+ * an American price at or above the European price and the intrinsic value, and each SOR engine
+ * close to a direct solve of the same problem. Fixed sweeps clamp after the solve as the direct
+ * engines do and must be within CHECK_SOR_TOL of them; psor_method (a control block, or any grid)
+ * solves the complementarity problem, as Brennan-Schwartz does, and must be within CHECK_LCP_TOL
+ * of it for Americans.
+ */
+static int check_bounds() {
+  const double spots[] = {80.0, 95.0, 120.0};
+  const char *direct[] = {"implicit", "cn"}, *sor[] = {"implicit_sor", "cn_sor"};
+  vector<double> grid(101);
+  int failed = 0, n = 0;
+
+  sinh_grid(101, -2.5, 2.5, 0.0, 0.1, grid.data());
+  for(int on_grid=0; on_grid<2; on_grid++) {
+    FDM_options base;
+
+    if(on_grid) {
+      base.grid = grid.data();
+      base.n_grid = (int)grid.size();
+    }
+    for(double S : spots) {
+      for(int cp=-1; cp<=1; cp+=2) {
+        double intrinsic = fmax(cp*(S - 100.0), 0.0);
+
+        for(int e=0; e<2; e++) {
+          double v[2];
+          FDM_options bs_opts = base;
+
+          bs_opts.american_solver = AMERICAN_BRENNAN_SCHWARTZ;
+          double v_bs = engine_by_name(sor[e])(S, 100.0, 0.05, 0.02, 0.25, 0.75, 0.05, 0.00125, cp, 1, &bs_opts);
+          for(int american=0; american<2; american++) {
+            FDM_options opts = base;
+
+            v[american] = engine_by_name(direct[e])(S, 100.0, 0.05, 0.02, 0.25, 0.75, 0.05, 0.00125, cp, american, &opts);
+            for(int control=0; control<2; control++) {
+              FDM_sor_control ctl;
+
+              opts.sor = control ? &ctl : 0;
+              double v_sor = engine_by_name(sor[e])(S, 100.0, 0.05, 0.02, 0.25, 0.75, 0.05, 0.00125, cp, american, &opts);
+              bool lcp = american && (control || on_grid);
+              double want = lcp ? v_bs : v[american];
+
+              n++;
+              if(!(fabs(v_sor - want) <= (lcp ? CHECK_LCP_TOL : CHECK_SOR_TOL))) {
+                printf("FAIL %s%s%s S=%g %s %s: %.10f, %s %.10f\n", sor[e], control ? " with a control block" : "", on_grid ? " on a grid" : "", S,
+                       (cp > 0) ? "call" : "put", american ? "american" : "european", v_sor, lcp ? "brennan_schwartz" : direct[e], want);
+                failed++;
+              }
+            }
+          }
+          n++;
+          if(!(v[1] >= v[0] - CHECK_SOR_TOL && v[1] >= intrinsic - CHECK_SOR_TOL && v_bs >= intrinsic - CHECK_SOR_TOL)) {
+            printf("FAIL %s%s S=%g %s: american %.10f, brennan_schwartz %.10f, european %.10f, intrinsic %.10f\n", direct[e], on_grid ? " on a grid" : "", S,
+                   (cp > 0) ? "call" : "put", v[1], v_bs, v[0], intrinsic);
+            failed++;
+          }
+        }
+      }
+    }
+  }
+  printf("bounds: %d cases\n", n);
+  return failed;
+}
+
+// Europeans priced to a tolerance by Richardson extrapolation against the closed form, which a
+// wrong scale of the final layer misses by far more than the grid error
+static int check_black_scholes() {
+  const double spots[] = {80.0, 100.0, 120.0}, tol = 1e-3;
+  FDM_engine engines[] = {ImplicitFDM, CN_FDM};
+  int failed = 0;
+  double worst = 0.0;
+
+  for(double S : spots) {
+    for(int cp=-1; cp<=1; cp+=2) {
+      double bs = (cp > 0) ? BlackScholesCall(S, 100.0, 0.05, 0.02, 0.25, 0.75) : BlackScholesPut(S, 100.0, 0.05, 0.02, 0.25, 0.75);
+
+      for(int e=0; e<2; e++) {
+        double v = price_to_tolerance(engines[e], S, 100.0, 0.05, 0.02, 0.25, 0.75, cp, 0, tol, 10000000L, 0, 0, 1);
+
+        worst = fmax(worst, fabs(v - bs));
+        if(!(fabs(v - bs) <= tol)) {
+          printf("FAIL %s S=%g %s to %.0e: %.10f, black scholes %.10f\n", (e == 0) ? "implicit" : "cn", S, (cp > 0) ? "call" : "put", tol, v, bs);
+          failed++;
+        }
+      }
+    }
+  }
+  printf("black scholes: largest difference %.1e, tolerance %.0e\n", worst, tol);
+  return failed;
+}
+
+// American price on a Cox-Ross-Rubinstein tree of n steps, exercise checked at every node
+static double binomial_american(double S, double K, double r, double q, double sigma, double expiry, int call_or_put, int n) {
+  double dt = expiry/n, u = exp(sigma*sqrt(dt)), p = (exp((r-q)*dt) - 1.0/u)/(u - 1.0/u), disc = exp(-r*dt);
+  vector<double> v(n+1);
+
+  for(int i=0; i<=n; i++) {
+    v[i] = fmax(call_or_put*(S*pow(u, 2*i-n) - K), 0.0);
+  }
+  for(int j=n-1; j>=0; j--) {
+    for(int i=0; i<=j; i++) {
+      v[i] = fmax(disc*(p*v[i+1] + (1.0-p)*v[i]), call_or_put*(S*pow(u, 2*i-j) - K));
+    }
+  }
+  return v[0];
+}
+
+// Americans priced to a tolerance against a binomial tree, the mean of 2000 and 2001 steps to
+// cancel most of its odd-even oscillation; the tree is allowed an error as large as tol
+static int check_binomial() {
+  const double spots[] = {80.0, 100.0, 120.0}, tol = 1e-3;
+  FDM_engine engines[] = {ImplicitFDM, CN_FDM};
+  int failed = 0;
+  double worst = 0.0;
+
+  for(double S : spots) {
+    for(int cp=-1; cp<=1; cp+=2) {
+      double tree = 0.5*(binomial_american(S, 100.0, 0.05, 0.02, 0.25, 0.75, cp, 2000) + binomial_american(S, 100.0, 0.05, 0.02, 0.25, 0.75, cp, 2001));
+
+      for(int e=0; e<2; e++) {
+        double v = price_to_tolerance(engines[e], S, 100.0, 0.05, 0.02, 0.25, 0.75, cp, 1, tol, 10000000L, 0, 0, 1);
+
+        worst = fmax(worst, fabs(v - tree));
+        if(!(fabs(v - tree) <= 2.0*tol)) {
+          printf("FAIL %s S=%g american %s to %.0e: %.10f, binomial %.10f\n", (e == 0) ? "implicit" : "cn", S, (cp > 0) ? "call" : "put", tol, v, tree);
+          failed++;
+        }
+      }
+    }
+  }
+  printf("binomial: largest difference %.1e, tolerance %.0e\n", worst, 2.0*tol);
+  return failed;
+}
+
+// the mixed precision packs against the double packs, each price within precision_tol
+static int check_mixed_precision() {
+  vector<FDM_contract> contracts;
+  int failed = 0;
+  double worst = 0.0;
+  FDM_options dbl, mixed;
+
+  for(int k=0; k<FDM_PACK_MIXED_LANES; k++) {
+    FDM_contract c = {100.0, 80.0 + 2.5*k, 0.03, 0.01, 0.15 + 0.02*k, 0.25 + 0.1*k, (k%2 == 0) ? 1 : -1, (k%4 < 2) ? 0 : 1, METHOD_CN};
+    contracts.push_back(c);
+  }
+  mixed.precision = PRECISION_MIXED;
+  for(int implicit=0; implicit<2; implicit++) {
+    vector<double> v_dbl(contracts.size()), v_mixed(contracts.size());
+    void (*pack)(int, const FDM_contract *, double, double, double *, const FDM_options *) = implicit ? ImplicitFDM_pack : CN_FDM_pack;
+
+    pack((int)contracts.size(), contracts.data(), 0.05, 0.00125, v_dbl.data(), &dbl);
+    pack((int)contracts.size(), contracts.data(), 0.05, 0.00125, v_mixed.data(), &mixed);
+    for(size_t i=0; i<contracts.size(); i++) {
+      worst = fmax(worst, fabs(v_mixed[i] - v_dbl[i]));
+      if(!(fabs(v_mixed[i] - v_dbl[i]) <= mixed.precision_tol)) {
+        printf("FAIL %s pack contract %d: mixed %.10f, double %.10f\n", implicit ? "implicit" : "cn", (int)i, v_mixed[i], v_dbl[i]);
+        failed++;
+      }
+    }
+  }
+  printf("mixed precision: largest difference %.1e, tolerance %.0e\n", worst, mixed.precision_tol);
+  return failed;
+}
+
+/**
+ * The in-place solvers allocate nothing with a reserved workspace, and an engine with a shared
+ * workspace and factorization allocates as often for four times the time steps
+ */
+static int check_allocations() {
+  int n = 101, failed = 0;
+  vector<double> a(3*n), b(n, 1.0), x(n);
+  FDM_workspace ws;
+  FDM_tridiag_factor op;
+  FDM_options opts;
+  long before, solver_news, engine_news[2];
+
+  for(int i=0; i<n; i++) {
+    a[3*i] = -0.5; a[3*i+1] = 2.0; a[3*i+2] = -0.5;
+  }
+  workspace_reserve(&ws, n);
+  before = allocations;
+  thomas_method(n, a.data(), b.data(), x.data(), &ws);
+  sor_method(n, a.data(), b.data(), x.data(), 1.2, 50, &ws);
+  solver_news = allocations - before;
+  if(solver_news != 0) {
+    printf("FAIL thomas_method and sor_method with a workspace: %ld allocations\n", solver_news);
+    failed++;
+  }
+
+  heat_operator_factor(n, 0.00125/(0.05*0.05), 1.0, &op);
+  opts.workspace = &ws;
+  opts.factor = &op;
+  for(int k=0; k<2; k++) {
+    before = allocations;
+    ImplicitFDM(100.0, 100.0, 0.05, 0.0, 0.2, (k == 0) ? 0.5 : 2.0, 0.05, 0.00125, -1, 1, &opts);
+    engine_news[k] = allocations - before;
+  }
+  if(engine_news[0] != engine_news[1]) {
+    printf("FAIL ImplicitFDM with a shared workspace: %ld allocations for T=0.5, %ld for T=2\n", engine_news[0], engine_news[1]);
+    failed++;
+  }
+  printf("allocations: %ld by the solvers, %ld per engine call at either expiry\n", solver_news, engine_news[0]);
+
+  tridiag_factor_free(&op);
+  workspace_free(&ws);
+  return failed;
+}
+
+int main() {
+  int failed = check_engines() + check_bounds() + check_black_scholes() + check_binomial() + check_mixed_precision() + check_allocations();
+
+  if(failed > 0) {
+    printf("%d checks failed\n", failed);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
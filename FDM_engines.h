@@ -0,0 +1,292 @@
+#ifndef FDM_ENGINES_H
+#define FDM_ENGINES_H
+
+#include "FDM_utils.h"
+
+/**
+ * Price and sensitivities of one option, filled by an engine when FDM_options::result is set.
+ * Delta, gamma and theta come from the final and penultimate layers of the march at no extra
+ * solve; vega and rho need bump_greeks and cost four more marches on the same grid.
+ */
+struct FDM_result {
+  double price = 0.0;
+  double delta = 0.0;          // dV/dS
+  double gamma = 0.0;          // d2V/dS2
+  double theta = 0.0;          // dV/dt, per year of calendar time
+  double vega = 0.0;           // dV/dsigma (bump_greeks only)
+  double rho = 0.0;            // dV/dr (bump_greeks only)
+  double expiry_solved = 0.0;  // maturity actually reached by the march, (N-1)*dtau/(0.5*sigma^2)
+  double alpha = 0.0;          // scale of the final layer y, V = K*exp(alpha*x + beta_tau)*y
+  double beta_tau = 0.0;
+};
+
+// arithmetic of the lane-batched engines
+enum FDM_precision {
+  PRECISION_DOUBLE = 0,
+  PRECISION_MIXED        // float solves corrected by double residuals
+};
+
+// solver of the American time step in the SOR engines
+enum FDM_american_solver {
+  AMERICAN_PSOR = 0,
+  AMERICAN_BRENNAN_SCHWARTZ
+};
+
+/**
+ * Optional controls for the finite difference engines.
+ * A default constructed FDM_options (or a null pointer) gives the plain behaviour.
+ *
+ * The engines march in time with two rolling columns of length M = 1 + (x_max-x_min)/dx,
+ * so intermediate time layers are not kept unless they are requested as snapshots:
+ *   int n_snapshots             number of layers requested
+ *   const int *snapshot_layers  time indices j (0 <= j < N) of the requested layers
+ *   double *snapshots           output (length n_snapshots*M), layer snapshot_layers[k]
+ *                               is copied to snapshots[k*M] ... snapshots[k*M+M-1]
+ *
+ * The SOR engines solve one tridiagonal system per time step. A workspace passed here is
+ * reused for those solves (and grown once if it is too small), so a caller pricing many options
+ * on one thread allocates the solver scratch space only once:
+ *   FDM_workspace *workspace    solver scratch space, a private one is used when null
+ *
+ * For American options the SOR engines by default iterate towards the unconstrained solution
+ * and clamp it to the early exercise value afterwards. The Brennan-Schwartz solver instead
+ * applies the constraint inside one direct O(M) sweep, which is exact for the step and faster:
+ *   FDM_american_solver american_solver   AMERICAN_PSOR (default) or AMERICAN_BRENNAN_SCHWARTZ
+ *
+ * The default SOR step runs a fixed 20 (implicit) or 15 (CN) sweeps from zero and leaves the
+ * boundary rows at zero. With a control block the SOR engines use psor_method instead: warm
+ * started from the previous layer, projected inside the sweep for Americans, stopped on a
+ * tolerance, with omega adapted from step to step. The block accumulates the sweep counts:
+ *   FDM_sor_control *sor        settings and statistics, the fixed sweeps are used when null
+ *
+ * The Thomas engines (ImplicitFDM, CN_FDM) factorize their constant matrix once per march.
+ * A factorization built with heat_operator_factor(M, dtau/(dx*dx), theta, f) can be shared by
+ * every option on the same grid (theta=1 for ImplicitFDM, theta=0.5 for CN_FDM); it is ignored
+ * when its M, w or theta do not match the call:
+ *   const FDM_tridiag_factor *factor   shared factorization, a private one is built when null
+ *
+ * The engines also march on a non-uniform grid in x, e.g. one clustered around the strike by
+ * sinh_grid, which reaches a given accuracy with far fewer nodes than the uniform one. dx is then
+ * ignored; the factorization to share is built with heat_operator_factor(n_grid, grid, dtau, theta, f).
+ * ExplicitFDM is then stable only while lw+uw <= 1 at every node (see grid_weights). The packs stay uniform:
+ *   int n_grid                  number of nodes
+ *   const double *grid          increasing nodes x = log(S/K), kept by the caller during the call
+ *
+ * The price is read at x = log(S/K) by cubic interpolation on the final layer. The same layer
+ * also values a whole ladder of spots, so one march replaces one call per spot:
+ *   int n_spots                 number of spots in the ladder
+ *   const double *spots         spot prices
+ *   double *spot_values         output (length n_spots), value of the option at each spot
+ *
+ * The transformed solution y(x, tau) does not depend on K (x = log(S/K), the payoff and the
+ * boundaries are scaled by K), so the final layer also prices a ladder of strikes at spot S:
+ *   int n_strikes               number of strikes in the ladder
+ *   const double *strikes       strike prices
+ *   double *strike_values       output (length n_strikes), value of the option at each strike
+ *
+ * With flat parameters an earlier expiry T' < expiry is just the earlier time layer
+ * tau' = 0.5*sigma^2*T' of the same march, so a whole term strip is captured on the fly,
+ * interpolating linearly in tau between the two layers around each tau'. Expiries beyond the
+ * last whole step are extrapolated from the last two layers:
+ *   int n_expiries              number of maturities in the strip
+ *   const double *expiries      maturities, each at most expiry
+ *   double *expiry_values       output (length n_expiries), value of the option at each maturity
+ *
+ * Crank-Nicholson damps the high frequencies of the payoff kink only weakly, which shows up as
+ * wiggles in gamma and a slower convergence near the strike. Rannacher start-up replaces each of
+ * the first steps by two implicit half steps (CN_FDM, CN_SORFDM and theta_fdm with 0 < theta < 1):
+ *   int rannacher_steps         number of start-up steps, 0 for none (usually 2)
+ *
+ * On grids of FDM_PARTITION_MIN_N nodes or more, ImplicitFDM and CN_FDM (and theta_fdm with
+ * STEP_FACTORED) solve each step with the partitioned solver of partition_factor instead of the
+ * serial Thomas sweep, unless a matching factorization is shared. Its blocks run side by side
+ * and on a team of threads, that of the workspace when one is given (kept between calls) and
+ * otherwise one of the call, shared by its bumped runs:
+ *   int solver_threads          threads of each solve, 0 for every hardware thread; 1 inside
+ *                               a batch that already runs one option per thread
+ *
+ * The lane-batched engines (ImplicitFDM_pack, CN_FDM_pack) can solve each step in float, twice
+ * the lanes per vector and half the bytes per substitution, for the change of the layer from a
+ * residual formed in double, which keeps the layers within a few float roundings of the change
+ * per step of the double march. When the drift so estimated exceeds the tolerance in price the
+ * pack is marched again with more refinement passes per step, then in double:
+ *   FDM_precision precision     PRECISION_DOUBLE (default) or PRECISION_MIXED
+ *   double precision_tol        largest estimated price difference to the double march
+ *
+ * Greeks from the same solve:
+ *   FDM_result *result          output, price with delta, gamma and theta
+ *   int bump_greeks             1 to also fill vega and rho by central bumps in sigma and r,
+ *                               reusing the workspace and factorization of the call
+ */
+struct FDM_options {
+  int n_snapshots = 0;
+  const int *snapshot_layers = 0;
+  double *snapshots = 0;
+  FDM_workspace *workspace = 0;
+  FDM_american_solver american_solver = AMERICAN_PSOR;
+  FDM_sor_control *sor = 0;
+  const FDM_tridiag_factor *factor = 0;
+  int n_grid = 0;
+  const double *grid = 0;
+  int n_spots = 0;
+  const double *spots = 0;
+  double *spot_values = 0;
+  int n_strikes = 0;
+  const double *strikes = 0;
+  double *strike_values = 0;
+  int n_expiries = 0;
+  const double *expiries = 0;
+  double *expiry_values = 0;
+  FDM_result *result = 0;
+  int bump_greeks = 0;
+  int rannacher_steps = 0;
+  int solver_threads = 0;
+  FDM_precision precision = PRECISION_DOUBLE;
+  double precision_tol = 1e-5;
+};
+
+// signature shared by the engines, used to reprice bumped inputs
+typedef double (*FDM_engine)(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts);
+
+// linear solver of each time step of theta_fdm
+enum FDM_step_solver {
+  STEP_EXPLICIT = 0,     // theta = 0, the new layer is the right hand side
+  STEP_THOMAS,           // thomas_method, the matrix is eliminated every step
+  STEP_FACTORED,         // factorized once per march, or shared through opts->factor
+  STEP_SOR,              // as the SOR engines: Brennan-Schwartz or psor_method when opts asks, else fixed sweeps
+  STEP_PSOR,             // psor_method to tolerance, with opts->sor or a default control block
+  STEP_BRENNAN_SCHWARTZ  // brennan_schwartz for Americans, thomas_method for Europeans
+};
+
+// one finite difference method as a theta scheme and the solver of its steps
+struct FDM_theta_scheme {
+  double theta;            // weight of the implicit part: 0 explicit, 0.5 Crank-Nicholson, 1 implicit
+  FDM_step_solver solver;
+  int sor_sweeps;          // sweeps of each fixed STEP_SOR solve
+  FDM_engine engine;       // engine repriced for bump_greeks, 0 for none
+};
+
+// pricing method of a contract in a batch or pack
+enum FDM_method {
+  METHOD_BLACK_SCHOLES = 0,
+  METHOD_EXPLICIT,
+  METHOD_IMPLICIT,
+  METHOD_CN,
+  METHOD_IMPLICIT_SOR,
+  METHOD_CN_SOR
+};
+
+/**
+ * One contract of a batch or pack, with the same conventions as the engines:
+ *   call_or_put (+1 for call, -1 for put)
+ *   amer_or_eur (0 for European option, 1 for American)
+ */
+struct FDM_contract {
+  double S, K, r, q, sigma, expiry;
+  int call_or_put;
+  int amer_or_eur;
+  FDM_method method;
+};
+
+// factorized theta scheme matrix of an engine: the shared one of opts when it matches the grid, else one built into local
+const FDM_tridiag_factor *shared_heat_operator(const FDM_options *opts, int M, double w, double dtau, double theta);
+const FDM_tridiag_factor *heat_operator(const FDM_options *opts, int M, double w, double dtau, double theta, FDM_tridiag_factor *local);
+
+// copies layer j (length M) into every snapshot slot that requested it
+void store_snapshot(const FDM_options *opts, int j, int M, const double *y);
+
+// option value K*exp(alpha*x+beta_tau)*y(x) at x = log(S/K) from the final layer y on the grid x, NaN off the grid
+double value_at_spot(double S, double K, double alpha, double beta_tau, int M, const double *x, const double *y);
+// fills opts->spot_values for the spot ladder of opts, if any
+void store_spot_values(const FDM_options *opts, double K, double alpha, double beta_tau, int M, const double *x, const double *y);
+// fills opts->strike_values for the strike ladder of opts at spot S, if any
+void store_strike_values(const FDM_options *opts, double S, double alpha, double beta_tau, int M, const double *x, const double *y);
+// fills the opts->expiry_values whose tau lies in (tau_prev, tau] (or beyond, on the last step) from layers y_prev and y
+void store_expiry_values(const FDM_options *opts, int last_step, double S, double K, double sigma, double alpha, double beta, double tau_prev, double tau, int M, const double *x, const double *y_prev, const double *y);
+// fills opts->result with price, delta, gamma and theta from the final layer y (at tau) and the layer y_prev (at tau_prev)
+void store_greeks(const FDM_options *opts, double S, double K, double sigma, double alpha, double beta, double tau, double tau_prev, int M, const double *x, const double *y, const double *y_prev);
+// fills vega and rho of opts->result when opts->bump_greeks is set, repricing with engine
+void store_bumped_greeks(const FDM_options *opts, FDM_engine engine, FDM_workspace *ws, const FDM_tridiag_factor *op, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur);
+
+double BlackScholesCall(double S, double K, double r, double q, double sigma, double expiry);
+double BlackScholesPut(double S, double K, double r, double q, double sigma, double expiry);
+double BlackScholesVega(double S, double K, double r, double q, double sigma, double expiry);
+
+double theta_fdm(const FDM_theta_scheme &scheme, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0);
+double ExplicitFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0);
+double ImplicitFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0);
+double CN_FDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0);
+double ImplicitSORFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0);
+double CN_SORFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0);
+
+// prices n strikes at spot S with one march of engine
+void price_strikes(FDM_engine engine, double S, int n, const double *strikes, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, double *values);
+
+// prices n maturities of one option with one march of engine
+void price_expiries(FDM_engine engine, double S, double K, int n, const double *expiries, double r, double q, double sigma, double dx, double dtau, int call_or_put, int amer_or_eur, double *values);
+
+// outcome of price_to_tolerance
+struct FDM_adaptive_result {
+  double value = 0.0;           // Richardson extrapolated value
+  double error_estimate = 0.0;  // estimated absolute error of value
+  double dx = 0.0;              // finest grid used
+  double dtau = 0.0;
+  long nodes = 0;               // grid nodes M*N summed over all solves
+  int solves = 0;
+  int converged = 0;            // 1 if error_estimate <= tol within the node budget
+};
+
+// prices one option to a target absolute error by refinement and Richardson extrapolation
+double price_to_tolerance(FDM_engine engine, double S, double K, double r, double q, double sigma, double expiry, int call_or_put, int amer_or_eur, double tol, long max_nodes, FDM_adaptive_result *res = 0, FDM_workspace *ws = 0, int solver_threads = 0);
+
+// outcome of implied_vol
+struct FDM_implied_result {
+  double vol = 0.0;             // implied volatility, NaN if the quote is outside the attainable prices
+  double price_error = 0.0;     // engine price at vol minus the quote
+  int iterations = 0;           // Newton / bisection steps
+  int solves = 0;               // engine marches
+  int converged = 0;            // 1 if the price or the bracket met the tolerance
+};
+
+// volatility at which engine reproduces a quoted price
+double implied_vol(FDM_engine engine, double price, double S, double K, double r, double q, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0, FDM_implied_result *res = 0);
+// closed form inversion of the European Black-Scholes price
+double black_scholes_implied_vol(double price, double S, double K, double r, double q, double expiry, int call_or_put);
+
+// settings and statistics of parareal_fdm
+struct FDM_parareal_control {
+  int slices = 0;               // time slices, 0 for one per thread
+  int threads = 0;              // threads of the fine propagators, 0 for every hardware thread
+  double coarse_theta = 0.5;    // theta of the coarse steps, Crank-Nicholson by default; 1 is used on a non-uniform grid
+  int coarse_steps = 16;        // coarse steps per slice
+  double tol = 1e-8;            // on the change of the slice end layers, relative to their size
+  int max_iter = 0;             // iterations at most, 0 for slices (exact after that many)
+  int iterations = 0;           // iterations of the last solve
+  int converged = 0;            // 1 if the last solve met tol or ran to exactness
+  double max_change = 0.0;      // largest change of a slice end layer in the last iteration
+  long critical_steps = 0;      // tridiagonal solves on the critical path, with a thread per slice
+  double model_speedup = 0.0;   // serial solves over critical_steps
+};
+
+// theta scheme march made parallel in time by Parareal
+double parareal_fdm(double theta, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts = 0, FDM_parareal_control *ctl = 0);
+
+// engine of a method, 0 for METHOD_BLACK_SCHOLES
+FDM_engine engine_for_method(FDM_method method);
+
+/**
+ * Lane-batched engines: the contracts of a pack share dx and dtau, hence the grid and the
+ * factorized matrix, and are marched together with their state interleaved lane by lane
+ * (y[i*FDM_PACK_LANES + lane]) so the sweeps vectorize across options (AVX-512, AVX2 or scalar,
+ * chosen at run time). Packs larger than FDM_PACK_LANES are split. The method field of the
+ * contracts is ignored and opts may only supply the factorization and the precision.
+ * In PRECISION_MIXED the substitutions run in float on FDM_PACK_MIXED_LANES lanes, twice as many
+ * per vector, while the layers and the residual of each step stay in double (see FDM_options).
+ */
+#define FDM_PACK_LANES 8
+#define FDM_PACK_MIXED_LANES 16
+
+void ImplicitFDM_pack(int n, const FDM_contract *contracts, double dx, double dtau, double *values, const FDM_options *opts = 0);
+void CN_FDM_pack(int n, const FDM_contract *contracts, double dx, double dtau, double *values, const FDM_options *opts = 0);
+
+#endif
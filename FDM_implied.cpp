@@ -0,0 +1,182 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Implied volatility of European and American quotes, inverting the closed form or a finite difference engine.
+*
+* */
+
+#include <cmath>
+#include <algorithm>
+#include "FDM_engines.h"
+
+using namespace std;
+
+#define VOL_MIN 1e-3
+#define VOL_MAX 5.0
+#define VOL_TOL 1e-7
+#define PRICE_TOL 1e-8
+#define MAX_ITER 60
+
+/**
+ * Inverts the Black-Scholes formula: Newton steps with the analytic vega, kept inside a
+ * bracket [VOL_MIN, VOL_MAX] that shrinks with every evaluation and bisected when Newton
+ * would leave it
+ * Inputs : double price (European quote)
+ *          double S, K, r, q, expiry, int call_or_put (as for the engines)
+ * Output : double vol, NaN if price is outside the range of the formula on the bracket
+ */
+double black_scholes_implied_vol(double price, double S, double K, double r, double q, double expiry, int call_or_put) {
+  double lo = VOL_MIN, hi = VOL_MAX, sigma, f, vega, next;
+  int iter;
+
+  f = (call_or_put > 0) ? BlackScholesCall(S, K, r, q, lo, expiry) : BlackScholesPut(S, K, r, q, lo, expiry);
+  if(price < f) return NAN;
+  f = (call_or_put > 0) ? BlackScholesCall(S, K, r, q, hi, expiry) : BlackScholesPut(S, K, r, q, hi, expiry);
+  if(price > f) return NAN;
+
+  // start at the inflection point of the price in sigma, where Newton converges from either side
+  sigma = min(max(sqrt(2.0*fabs(log(S/K) + (r-q)*expiry)/expiry), 0.2), hi);
+  for(iter=0; iter<MAX_ITER; iter++) {
+    f = ((call_or_put > 0) ? BlackScholesCall(S, K, r, q, sigma, expiry) : BlackScholesPut(S, K, r, q, sigma, expiry)) - price;
+    if(fabs(f) < PRICE_TOL) break;
+    if(f > 0.0) hi = sigma;
+    else lo = sigma;
+    vega = BlackScholesVega(S, K, r, q, sigma, expiry);
+    next = (vega > 0.0) ? sigma - f/vega : lo;
+    if(next <= lo || next >= hi) next = 0.5*(lo + hi);
+    if(fabs(next - sigma) < VOL_TOL) return next;
+    sigma = next;
+  }
+  return sigma;
+}
+
+// engine price carried from the last whole time step to the full expiry with the grid theta,
+// which makes it continuous in sigma although the number of steps jumps with sigma
+static double carried_price(FDM_engine engine, FDM_options *opts, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur) {
+  FDM_result res;
+
+  opts->result = &res;
+  engine(S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  opts->result = 0;
+  return res.price - res.theta*(expiry - res.expiry_solved);
+}
+
+/**
+ * Implied volatility of a quote under one of the engines
+ *   The search starts from the closed form inversion of the quote (exact for a European
+ *   contract up to the grid error, a close lower bound of the vol for an American one) and
+ *   takes Newton steps. The first slope is the grid vega by a forward bump, later ones the
+ *   secant through the last two marches, so an iteration costs one march. Every march shrinks
+ *   a bracket on the vol (the price increases with sigma) and a step that would leave the
+ *   bracket is replaced by bisection, as in Brent's method, so the search cannot diverge.
+ *   Stops when the price matches to PRICE_TOL or the vol is known to VOL_TOL.
+ *   The Thomas factorization (ImplicitFDM, CN_FDM) depends on w = dtau/dx^2 but not on sigma,
+ *   and the SOR workspace only on the grid size, so both are built once for all iterations
+ *   unless opts already supplies them.
+ * Inputs: FDM_engine engine (ExplicitFDM, ImplicitFDM, CN_FDM, ImplicitSORFDM or CN_SORFDM)
+ *         double price (quote)
+ *         double S, K, r, q, expiry, dx, dtau, int call_or_put, amer_or_eur (as for the engines)
+ *         const FDM_options *opts (optional, workspace, factorization and grid to use)
+ * Output: double vol (implied volatility, NaN if no vol in [VOL_MIN, VOL_MAX] gives the quote
+ *         or an American quote is below its intrinsic value)
+ *         FDM_implied_result *res (optional), price error and cost of the search
+ */
+double implied_vol(FDM_engine engine, double price, double S, double K, double r, double q, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts, FDM_implied_result *res) {
+  FDM_options local;
+  FDM_workspace ws;
+  FDM_tridiag_factor op;
+  double lo = VOL_MIN, hi = VOL_MAX, h = 1e-4;
+  double sigma, f, f_prev = 0.0, sigma_prev = 0.0, slope, next, v;
+  int iter, solves = 0, converged = 0, has_lo = 0, has_hi = 0, newton;
+
+  if(opts != 0) local = *opts;
+  local.n_snapshots = 0;
+  local.n_spots = 0;
+  local.spot_values = 0;
+  local.n_strikes = 0;
+  local.strike_values = 0;
+  local.n_expiries = 0;
+  local.expiry_values = 0;
+  local.bump_greeks = 0;
+
+  // an American quote below the value of exercising now has no vol, and the search would only
+  // find the garbage prices of the grid at vols near VOL_MIN
+  if(amer_or_eur == 1 && price < fmax(call_or_put*(S - K), 0.0)) {
+    if(res != 0) {
+      res->vol = NAN;
+      res->price_error = NAN;
+      res->iterations = 0;
+      res->solves = 0;
+      res->converged = 0;
+    }
+    return NAN;
+  }
+
+  if(local.workspace == 0) local.workspace = &ws;
+  if(local.factor == 0 && local.grid == 0 && (engine == ImplicitFDM || engine == CN_FDM)) {
+    heat_operator_factor(1 + ((2.5 - (-2.5))/dx), dtau/(dx*dx), (engine == ImplicitFDM) ? 1.0 : 0.5, &op);
+    local.factor = &op;
+  }
+
+  sigma = black_scholes_implied_vol(price, S, K, r, q, expiry, call_or_put);
+  if(std::isnan(sigma)) sigma = 0.2;
+  sigma = min(max(sigma, 2.0*VOL_MIN), 0.5*VOL_MAX);
+
+  f = carried_price(engine, &local, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur) - price;
+  solves++;
+  for(iter=1; iter<=MAX_ITER; iter++) {
+    if(fabs(f) < PRICE_TOL) {
+      converged = 1;
+      break;
+    }
+    if(f > 0.0) {
+      hi = sigma;
+      has_hi = 1;
+    } else {
+      lo = sigma;
+      has_lo = 1;
+    }
+
+    if(iter == 1) {
+      v = carried_price(engine, &local, S, K, r, q, sigma + h, expiry, dx, dtau, call_or_put, amer_or_eur);
+      solves++;
+      slope = (v - (f + price))/h;
+    } else {
+      slope = (f - f_prev)/(sigma - sigma_prev);
+    }
+    next = (slope > 0.0) ? sigma - f/slope : lo;
+    newton = (next > lo && next < hi);
+    if(!newton) next = 0.5*(lo + hi);
+
+    sigma_prev = sigma;
+    f_prev = f;
+    sigma = next;
+    f = carried_price(engine, &local, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur) - price;
+    solves++;
+
+    // bisection steps towards an end that no march has priced yet do not show convergence
+    if((newton && fabs(sigma - sigma_prev) < VOL_TOL) || (has_lo && has_hi && hi - lo < VOL_TOL)) {
+      converged = 1;
+      break;
+    }
+  }
+
+  // the price jumps where the number of time steps changes with sigma; a bracket that closed
+  // on such a jump instead of a root is not a match of the quote
+  if(converged && fabs(f) > 1e-6*(1.0 + fabs(price))) converged = 0;
+
+  // a quote beyond the prices at the ends of the bracket has no implied vol
+  if(!converged && fabs(f) >= PRICE_TOL && (!has_lo || !has_hi)) sigma = NAN;
+
+  if(res != 0) {
+    res->vol = sigma;
+    res->price_error = f;
+    res->iterations = min(iter, MAX_ITER);
+    res->solves = solves;
+    res->converged = converged;
+  }
+
+  workspace_free(&ws);
+  tridiag_factor_free(&op);
+  return sigma;
+}
@@ -13,31 +13,40 @@
 *
 * As follows:
 * $ make
-* g++ FDM_main.cpp ImplicitFDM.cpp ExplicitFDM.cpp CN_FDM.cpp \
-* ImplicitSORFDM.cpp CN_SORFDM.cpp FDM_utils.cpp \
-* BlackScholesFormula.cpp -o FDM
+* g++ -O2 -pthread FDM_main.cpp ImplicitFDM.cpp ExplicitFDM.cpp CN_FDM.cpp \
+* ImplicitSORFDM.cpp CN_SORFDM.cpp FDM_theta.cpp FDM_utils.cpp FDM_partition.cpp \
+* BlackScholesFormula.cpp FDM_batch.cpp FDM_server.cpp FDM_cache.cpp FDM_surface_file.cpp \
+* FDM_pack.cpp FDM_adaptive.cpp FDM_implied.cpp FDM_parareal.cpp FDM_profile.cpp -o FDM
 *
 * $ ./FDM
 *
+* To price a list of contracts on all cores (one "S,K,r,q,sigma,T,call|put,european|american,method" per line):
+* $ ./FDM --batch contracts.csv [--threads n] [--dx 0.05] [--dtau 0.00125] [--tol err [--max-nodes n]] [--implied] [--precision double|mixed [--precision-tol err]] [--cache-mb n] [--surfaces file] [--save-surfaces file] [--profile out.json]
+*
+* To keep the engines warm and answer "price ..." / "greeks ..." / "stats" requests line by line:
+* $ ./FDM --serve [--socket path] [--threads n] [--dx 0.05] [--dtau 0.00125] [--cache-mb n] [--surfaces file]
+*
 */
 
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <cstring>
 #include "FDM_utils.h"
+#include "FDM_engines.h"
+#include "FDM_batch.h"
+#include "FDM_server.h"
 
 using namespace std;
 
-// function prototypes defined in other files
-double BlackScholesCall(double S, double K, double r, double q, double sigma, double expiry);
-double BlackScholesPut(double S, double K, double r, double q, double sigma, double expiry);
-double ExplicitFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur);
-double ImplicitFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur);
-double CN_FDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur);
-double ImplicitSORFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur);
-double CN_SORFDM(double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur);
+int main(int argc, char **argv) {
+  for(int k=1; k<argc; k++) {
+    if(strcmp(argv[k], "--serve") == 0) return server_main(argc, argv); // ./FDM --serve answers requests until stopped
+  }
+  if(argc > 1) {
+    return batch_main(argc, argv); // ./FDM --batch contracts.csv prices a whole book
+  }
 
-int main() {
   double rate = 0.03;     //risk free rate
   double stock = 20.0;    //spot price of stock
   double sigma=0.8;       //volatility
@@ -58,30 +67,30 @@ int main() {
   BSEurCall = BlackScholesCall(stock,K,rate,div,sigma,T);
   BSEurPut = BlackScholesPut(stock,K,rate,div,sigma,T);
 
-  ExEurCall = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
-  ExEurPut = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
-  ExAmCall = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
-  ExAmPut = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
-
-  ImEurCall = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
-  ImEurPut = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
-  ImAmCall = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
-  ImAmPut = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
-
-  CNEurCall = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
-  CNEurPut = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
-  CNAmCall = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
-  CNAmPut = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
-
-  ImSOREurCall = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
-  ImSOREurPut = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
-  ImSORAmCall = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
-  ImSORAmPut = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
-
-  CNSOREurCall = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
-  CNSOREurPut = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
-  CNSORAmCall = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
-  CNSORAmPut = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
+  ExEurCall = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
+  ExEurPut = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
+  ExAmCall = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
+  ExAmPut = ExplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
+
+  ImEurCall = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
+  ImEurPut = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
+  ImAmCall = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
+  ImAmPut = ImplicitFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
+
+  CNEurCall = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
+  CNEurPut = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
+  CNAmCall = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
+  CNAmPut = CN_FDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
+
+  ImSOREurCall = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
+  ImSOREurPut = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
+  ImSORAmCall = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
+  ImSORAmPut = ImplicitSORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
+
+  CNSOREurCall = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,0);
+  CNSOREurPut = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,0);
+  CNSORAmCall = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,1,1);
+  CNSORAmPut = CN_SORFDM(stock,K,rate,div,sigma,T,dx,dtau,-1,1);
 
   // Code below is for formatting output table
   cout << endl << "Table 1: Summary of values calculated by different numeric methods" << endl << endl;
@@ -0,0 +1,392 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Implicit and Crank-Nicholson finite difference methods for packs of options, marched together in SIMD lanes.
+*
+* */
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include "FDM_utils.h"
+#include "FDM_engines.h"
+
+using namespace std;
+
+// the march is compiled for AVX-512, AVX2 and plain x86-64, and the best one is picked at load time
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define FDM_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define FDM_SIMD_CLONES
+#endif
+
+// at -O2 GCC only vectorizes loops of one element width; the mixed march converts float to double
+#if defined(__GNUC__) && !defined(__clang__)
+#define FDM_VECTORIZE_MIXED __attribute__((optimize("vect-cost-model=dynamic")))
+#else
+#define FDM_VECTORIZE_MIXED
+#endif
+
+#define W FDM_PACK_LANES
+
+/**
+ * Marches one pack of W lanes, all arrays interleaved as v[i*W + lane]
+ * Inputs: int M, int N_max (points in space, largest number of time layers of the pack)
+ *         double w, theta (dtau/dx^2, 1 for implicit and 0.5 for Crank-Nicholson)
+ *         FDM_tridiag_factor *op (factorization of the matrix shared by all lanes)
+ *         double *y_old (length=M*W), initial condition, overwritten
+ *         double *obstacle (length=M*W), payoff at tau = 0, -HUGE_VAL for European lanes
+ *         double *lo, *hi (length=N_max*W), boundary values at x_min and x_max for each step
+ *         double *ex (length=N_max*W), scale of the obstacle at each step, exp(-beta*tau)
+ *         int *last (length=W), index of the last time layer of each lane
+ * Output: double *y_final (length=M*W), last time layer of each lane
+ */
+FDM_SIMD_CLONES
+static void pack_march(int M, int N_max, double w, double theta, const FDM_tridiag_factor *op,
+                       double *y_old, double *y_new, double *__restrict__ b, const double *__restrict__ obstacle,
+                       const double *lo, const double *hi, const double *ex, const int *last, double *y_final) {
+  int i, j, l;
+  double *y_tmp;
+  const double *lower = op->lower, *upper = op->upper, *inv_pivot = op->inv_pivot;
+  double cw = (1.0 - theta)*w; // weight of the explicit part (0 for implicit)
+
+  for(l=0; l<W; l++) {
+    if(last[l] == 0) {
+      for(i=0; i<M; i++) y_final[i*W+l] = y_old[i*W+l];
+    }
+  }
+
+  for(j=1; j<N_max; j++) {
+    // right hand side, the boundary rows carry the boundary conditions
+    for(l=0; l<W; l++) {
+      b[l] = lo[j*W+l];
+      b[(M-1)*W+l] = hi[j*W+l];
+    }
+    for(i=1; i<M-1; i++) {
+      for(l=0; l<W; l++) {
+        b[i*W+l] = y_old[i*W+l] + cw*(y_old[(i-1)*W+l] - 2.0*y_old[i*W+l] + y_old[(i+1)*W+l]);
+      }
+    }
+
+    // forward substitution, then backward substitution into y_new
+    for(i=1; i<M; i++) {
+      for(l=0; l<W; l++) {
+        b[i*W+l] -= lower[i]*b[(i-1)*W+l];
+      }
+    }
+    for(l=0; l<W; l++) {
+      b[(M-1)*W+l] *= inv_pivot[M-1];
+    }
+    for(i=M-2; i>=0; i--) {
+      for(l=0; l<W; l++) {
+        b[i*W+l] = (b[i*W+l] - upper[i]*b[(i+1)*W+l])*inv_pivot[i];
+      }
+    }
+    // the obstacle is applied after the solve, as in the scalar engines; a compare rather than
+    // fmax, which GCC does not vectorize without -ffinite-math-only
+    for(i=0; i<M; i++) {
+      for(l=0; l<W; l++) {
+        double o = ex[j*W+l]*obstacle[i*W+l];
+        y_new[i*W+l] = (b[i*W+l] > o) ? b[i*W+l] : o; // check for early exercise
+      }
+    }
+
+    for(l=0; l<W; l++) {
+      if(last[l] == j) {
+        for(i=0; i<M; i++) y_final[i*W+l] = y_new[i*W+l];
+      }
+    }
+    y_tmp = y_old;
+    y_old = y_new;
+    y_new = y_tmp;
+  }
+}
+
+#define WM FDM_PACK_MIXED_LANES
+
+/**
+ * Mixed precision march of one pack of WM lanes, arrays interleaved as in pack_march
+ *   The layers stay in double; each step solves for the change of the layer,
+ *     A (y_new - y) = rhs - A y,
+ *   with the residual formed in double from the current y (y_old on the first pass, y_new after)
+ *   and the substitutions run in float, WM lanes in the vectors that held W doubles. Every further
+ *   pass refines y_new from a fresh double residual. The early exercise value is applied after the
+ *   last pass, as in pack_march.
+ *   The substitutions of a diagonally dominant system are accurate component by component, so a
+ *   float solve of a change d is off by about FLT_EPSILON*cond(A)*|d| at each node, cond(A) <= 1 +
+ *   4*theta*w, and the layer adds those errors up step by step. Rounding errors of successive steps
+ *   are independent, so they grow as the root of the sum of their squares; taken at the four nodes
+ *   the price is interpolated from, this estimates how far each lane drifts from the double march.
+ * Inputs: as pack_march, with a (length=3*M) the matrix in double, the factorization op rounded to
+ *         float in lower, upper, inv_pivot (length=M), int passes (solves per step, at least 1) and
+ *         int *spot (length=WM) the node left of each spot, between 1 and M-3
+ * Output: double *y_final (length=M*WM), last time layer of each lane
+ *         double *drift (length=WM), estimated difference of each final layer to the double march
+ */
+FDM_SIMD_CLONES FDM_VECTORIZE_MIXED
+static void pack_march_mixed(int M, int N_max, double w, double theta, const double *__restrict__ a,
+                             const float *__restrict__ lower, const float *__restrict__ upper, const float *__restrict__ inv_pivot, int passes,
+                             double *y_old, double *y_new, float *__restrict__ b, const double *__restrict__ obstacle,
+                             const double *lo, const double *hi, const double *ex, const int *last, const int *spot, double *y_final, double *drift) {
+  int i, j, l, pass, last_pass;
+  double *y_tmp, *y;
+  double cw = (1.0 - theta)*w; // weight of the explicit part (0 for implicit)
+  double eps = FLT_EPSILON*(1.0 + 4.0*theta*w);
+
+  for(l=0; l<WM; l++) {
+    drift[l] = 0.0;
+    if(last[l] == 0) {
+      for(i=0; i<M; i++) y_final[i*WM+l] = y_old[i*WM+l];
+    }
+  }
+
+  for(j=1; j<N_max; j++) {
+    for(pass=0; pass<passes; pass++) {
+      y = (pass == 0) ? y_old : y_new;
+
+      // residual of the step equation in double, rounded to float and forward substituted in the same sweep
+      for(l=0; l<WM; l++) {
+        b[l] = (float)(lo[j*WM+l] - (a[1]*y[l] + a[2]*y[WM+l]));
+      }
+      for(i=1; i<M-1; i++) {
+        for(l=0; l<WM; l++) {
+          double rhs = y_old[i*WM+l] + cw*(y_old[(i-1)*WM+l] - 2.0*y_old[i*WM+l] + y_old[(i+1)*WM+l]);
+          float r = (float)(rhs - (a[3*i]*y[(i-1)*WM+l] + a[3*i+1]*y[i*WM+l] + a[3*i+2]*y[(i+1)*WM+l]));
+          b[i*WM+l] = r - lower[i]*b[(i-1)*WM+l];
+        }
+      }
+      for(l=0; l<WM; l++) {
+        float r = (float)(hi[j*WM+l] - (a[3*(M-1)]*y[(M-2)*WM+l] + a[3*(M-1)+1]*y[(M-1)*WM+l]));
+        b[(M-1)*WM+l] = (r - lower[M-1]*b[(M-2)*WM+l])*inv_pivot[M-1];
+      }
+
+      // backward substitution in float, the change added to the layer on the way; the early
+      // exercise value is applied after the last pass, as in pack_march
+      last_pass = (pass == passes-1);
+      for(i=M-1; i>=0; i--) {
+        if(i < M-1) {
+          for(l=0; l<WM; l++) {
+            b[i*WM+l] = (b[i*WM+l] - upper[i]*b[(i+1)*WM+l])*inv_pivot[i];
+          }
+        }
+        if(last_pass) {
+          for(l=0; l<WM; l++) {
+            double v = y[i*WM+l] + b[i*WM+l], o = ex[j*WM+l]*obstacle[i*WM+l];
+            y_new[i*WM+l] = (v > o) ? v : o; // check for early exercise
+          }
+        } else {
+          for(l=0; l<WM; l++) {
+            y_new[i*WM+l] = y[i*WM+l] + b[i*WM+l];
+          }
+        }
+      }
+    }
+
+    // only the change solved last carries the float error into the layer, read at the spot
+    for(l=0; l<WM; l++) {
+      if(j <= last[l]) {
+        double d = 0.0;
+        for(i=spot[l]-1; i<=spot[l]+2; i++) d += fabs(b[i*WM+l]);
+        drift[l] += d*d;
+      }
+    }
+    for(l=0; l<WM; l++) {
+      if(last[l] == j) {
+        for(i=0; i<M; i++) y_final[i*WM+l] = y_new[i*WM+l];
+      }
+    }
+    y_tmp = y_old;
+    y_old = y_new;
+    y_new = y_tmp;
+  }
+  for(l=0; l<WM; l++) drift[l] = eps*sqrt(drift[l]);
+}
+
+/**
+ * Prices a pack of options with the implicit (theta=1) or Crank-Nicholson (theta=0.5) scheme,
+ * W lanes at a time. Per lane the arithmetic is the one of ImplicitFDM / CN_FDM.
+ * With opts->precision = PRECISION_MIXED the lanes are WM at a time and marched by
+ * pack_march_mixed, one float solve per step; a pack with a lane whose estimated drift in price
+ * exceeds opts->precision_tol is marched again with one more refinement pass per step, up to
+ * three, and after that in double. Each pack starts from the passes the one before it needed.
+ */
+static void theta_pack(int n, const FDM_contract *contracts, double dx, double dtau, double theta, double *values, const FDM_options *opts) {
+  int i, j, l, p, N_max, passes, lanes, first_passes = 1;
+  int M, N[WM], last[WM], spot[WM];
+  int mixed = (opts != 0 && opts->precision == PRECISION_MIXED);
+  double x_min = -2.5, x_max = 2.5;
+  double w = dtau/(dx*dx);
+  double qp[WM], alpha[WM], beta[WM], drift[WM];
+  double *x, *y_init, *y_old, *y_new, *y_final, *y_lane, *b, *obstacle, *lo, *hi, *ex, *a = 0;
+  float *b_float = 0, *lower = 0, *upper = 0, *inv_pivot = 0;
+  FDM_tridiag_factor local_op;
+  const FDM_tridiag_factor *op;
+
+  M = 1 + ((x_max - x_min)/dx);
+  x = new double[M];
+  for(i=0; i<M; i++) {
+    x[i] = x_min + i*dx;
+  }
+
+  if(opts != 0 && opts->factor != 0 && opts->factor->n == M && opts->factor->w == w && opts->factor->theta == theta) {
+    op = opts->factor;
+  } else {
+    heat_operator_factor(M, w, theta, &local_op);
+    op = &local_op;
+  }
+
+  lanes = mixed ? WM : W;
+  y_init = new double[M*lanes];
+  y_old = new double[M*lanes];
+  y_new = new double[M*lanes];
+  y_final = new double[M*lanes];
+  y_lane = new double[M];
+  b = new double[M*lanes];
+  obstacle = new double[M*lanes];
+
+  // the matrix in double for the residuals, its factorization rounded to float for the solves
+  if(mixed) {
+    double *lw = new double[M];
+
+    for(i=0; i<M; i++) {
+      lw[i] = w;
+    }
+    a = new double[3*M];
+    heat_operator_matrix(M, lw, lw, theta, a);
+    delete [] lw;
+    b_float = new float[M*lanes];
+    lower = new float[M];
+    upper = new float[M];
+    inv_pivot = new float[M];
+    for(i=0; i<M; i++) {
+      lower[i] = (float)op->lower[i];
+      upper[i] = (float)op->upper[i];
+      inv_pivot[i] = (float)op->inv_pivot[i];
+    }
+  }
+
+  for(p=0; p<n; p+=lanes) {
+    // lanes beyond the end of the input repeat the last contract and are discarded
+    N_max = 1;
+    for(l=0; l<lanes; l++) {
+      const FDM_contract &c = contracts[min(p+l, n-1)];
+      double rp = 2*c.r/(c.sigma*c.sigma);
+      qp[l] = 2*(c.r-c.q)/(c.sigma*c.sigma);
+      alpha[l] = -0.5*(qp[l]-1);
+      beta[l] = -0.25*(qp[l]-1)*(qp[l]-1) - rp;
+      N[l] = 1 + ((0.5*(c.sigma*c.sigma)*c.expiry)/dtau);
+      last[l] = N[l]-1;
+      N_max = max(N_max, N[l]);
+      spot[l] = min(max((int)floor((log(c.S/c.K) - x_min)/dx), 1), M-3);
+
+      for(i=0; i<M; i++) {
+        double payoff = c.call_or_put*(exp(0.5*x[i]*(qp[l]+1))-exp(0.5*x[i]*(qp[l]-1)));
+        // Initial condition (at tau=0)
+        y_init[i*lanes+l] = fmax(payoff, 0.0);
+        obstacle[i*lanes+l] = (c.amer_or_eur==1) ? payoff : -HUGE_VAL;
+      }
+    }
+
+    // boundary conditions at x=-2.5 and x=2.5 and the scale of the obstacle for every step of
+    // every lane, geometric sequences in j so each step costs one multiplication
+    lo = new double[N_max*lanes];
+    hi = new double[N_max*lanes];
+    ex = new double[N_max*lanes];
+    for(l=0; l<lanes; l++) {
+      const FDM_contract &c = contracts[min(p+l, n-1)];
+      double lo_bc = exp(0.5*(qp[l]-1)*x[0]), lo_growth = exp(0.25*(qp[l]-1)*(qp[l]-1)*dtau);
+      double hi_bc = exp(0.5*(qp[l]+1)*x[M-1]), hi_growth = exp(0.25*(qp[l]+1)*(qp[l]+1)*dtau);
+      double ex_bc = 1.0, ex_growth = exp(-beta[l]*dtau);
+      for(j=0; j<N_max; j++) {
+        lo[j*lanes+l] = (c.call_or_put>0)?0.0:theta*w*lo_bc;
+        hi[j*lanes+l] = (c.call_or_put>0)?theta*w*hi_bc:0.0;
+        ex[j*lanes+l] = ex_bc;
+        lo_bc *= lo_growth;
+        hi_bc *= hi_growth;
+        ex_bc *= ex_growth;
+      }
+    }
+
+    if(mixed) {
+      for(passes=first_passes; passes<=3; passes++) {
+        double worst = 0.0;
+
+        copy(y_init, y_init + M*lanes, y_old);
+        pack_march_mixed(M, N_max, w, theta, a, lower, upper, inv_pivot, passes, y_old, y_new, b_float, obstacle, lo, hi, ex, last, spot, y_final, drift);
+        // the drift in price units at each spot: K*exp(alpha*x+beta*tau) times the drift of y
+        for(l=0; l<lanes && p+l<n; l++) {
+          const FDM_contract &c = contracts[p+l];
+          worst = max(worst, c.K*exp(alpha[l]*log(c.S/c.K) + beta[l]*(last[l]*dtau))*drift[l] - opts->precision_tol);
+        }
+        if(worst <= 0.0) break;
+      }
+      first_passes = min(passes, 3);
+      // still too far off: the pack is marched in double, W lanes at a time
+      if(passes > 3) {
+        FDM_options dbl = *opts;
+
+        dbl.precision = PRECISION_DOUBLE;
+        dbl.factor = op;
+        theta_pack(min(lanes, n-p), contracts + p, dx, dtau, theta, values + p, &dbl);
+        delete [] lo;
+        delete [] hi;
+        delete [] ex;
+        continue;
+      }
+    } else {
+      copy(y_init, y_init + M*lanes, y_old);
+      pack_march(M, N_max, w, theta, op, y_old, y_new, b, obstacle, lo, hi, ex, last, y_final);
+    }
+
+    // value of each option at x = log(S/K), interpolated on its final layer
+    for(l=0; l<lanes && p+l<n; l++) {
+      for(i=0; i<M; i++) y_lane[i] = y_final[i*lanes+l];
+      values[p+l] = value_at_spot(contracts[p+l].S, contracts[p+l].K, alpha[l], beta[l]*(last[l]*dtau), M, x, y_lane);
+    }
+
+    delete [] lo;
+    delete [] hi;
+    delete [] ex;
+  }
+
+  delete [] x;
+  delete [] y_init;
+  delete [] y_old;
+  delete [] y_new;
+  delete [] y_final;
+  delete [] y_lane;
+  delete [] b;
+  delete [] obstacle;
+  delete [] a;
+  delete [] b_float;
+  delete [] lower;
+  delete [] upper;
+  delete [] inv_pivot;
+  tridiag_factor_free(&local_op);
+}
+
+/**
+ * Solves Black Scholes equation using Implicit finite difference method for a pack of options
+ * Inputs: int n (number of contracts)
+ *         FDM_contract *contracts (length=n), all priced on the same dx and dtau
+ *         double dx (step size in space)
+ *         double dtau (step size in time)
+ *         const FDM_options *opts (optional, may supply the factorization for theta=1 and the precision)
+ * Output: double *values (length=n), value of each option
+ */
+void ImplicitFDM_pack(int n, const FDM_contract *contracts, double dx, double dtau, double *values, const FDM_options *opts) {
+  theta_pack(n, contracts, dx, dtau, 1.0, values, opts);
+}
+
+/**
+ * Solves Black Scholes equation using Crank-Nicholson finite difference method for a pack of options
+ * Inputs: int n (number of contracts)
+ *         FDM_contract *contracts (length=n), all priced on the same dx and dtau
+ *         double dx (step size in space)
+ *         double dtau (step size in time)
+ *         const FDM_options *opts (optional, may supply the factorization for theta=0.5 and the precision)
+ * Output: double *values (length=n), value of each option
+ */
+void CN_FDM_pack(int n, const FDM_contract *contracts, double dx, double dtau, double *values, const FDM_options *opts) {
+  theta_pack(n, contracts, dx, dtau, 0.5, values, opts);
+}
@@ -0,0 +1,406 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Parareal mode of the theta scheme: the time interval is cut into slices marched at once on a team of threads,
+*              stitched together by a coarse propagator and corrected until the slice ends settle.
+*
+* */
+
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FDM_utils.h"
+#include "FDM_engines.h"
+
+using namespace std;
+
+// matrix weights and factorization of a coarse step
+struct coarse_operator {
+  vector<double> lw, uw;
+  FDM_tridiag_factor f;
+};
+
+// everything the propagators of one solve share, read only once the solve has started
+struct parareal_plan {
+  int M, N, call_or_put, rannacher;
+  double theta;
+  const double *lw, *uw, *lw_half, *uw_half;
+  const double *lo_bc, *hi_bc;      // boundary values at every fine time layer
+  const double *lo_mid, *hi_mid;    // and half a step before it, for the Rannacher half steps
+  const double *obstacle;           // payoff at tau = 0, null for Europeans
+  const double *ex_bc, *ex_mid;     // scale of the obstacle at every fine time layer, and half a step before it
+  const FDM_tridiag_factor *fine, *half;
+  vector<int> slice_start;          // slice p runs from layer slice_start[p] to slice_start[p+1]
+  int coarse_steps;                 // coarse steps per slice
+  double coarse_theta;
+  map<int, coarse_operator> coarse; // coarse step over that many fine steps
+};
+
+/**
+ * One theta step from y_from to y_to with the boundary values lo, hi at its end, as in the
+ * march of FDM_theta.cpp: the boundary rows carry th*lw*bc (lw*bc when th = 0) and the solution
+ * is clamped to the obstacle times ex, if any. f is null for th = 0, b is scratch space of length M.
+ */
+static void parareal_step(int M, int call_or_put, double th, const double *lw, const double *uw, double lo, double hi, const FDM_tridiag_factor *f, const double *obstacle, double ex, const double *y_from, double *y_to, double *b) {
+  double bw = (th > 0.0) ? th : 1.0;
+  double *rhs = (f != 0) ? b : y_to;
+  int i;
+
+  rhs[0] = (call_or_put>0)?0.0:bw*lw[0]*lo;
+  if(th < 1.0) {
+    for(i=1; i<M-1; i++) {
+      rhs[i] = y_from[i]+(1.0-th)*(lw[i]*y_from[i-1]-(lw[i]+uw[i])*y_from[i]+uw[i]*y_from[i+1]);
+    }
+  } else {
+    for(i=1; i<M-1; i++) {
+      rhs[i] = y_from[i];
+    }
+  }
+  rhs[M-1] = (call_or_put>0)?bw*uw[M-1]*hi:0.0;
+
+  if(f != 0) tridiag_solve(f, rhs, y_to);
+  if(obstacle != 0) {
+    // the explicit step leaves its boundary rows unprojected, the implicit ones project every row
+    for(i=(f != 0) ? 0 : 1; i<((f != 0) ? M : M-1); i++) {
+      y_to[i] = fmax(y_to[i],ex*obstacle[i]);
+    }
+  }
+}
+
+// fine propagator of slice p: its layers one step at a time from y, in place; y_prev receives the layer before the last
+static void fine_slice(const parareal_plan &plan, int p, double *y, double *y_prev, double *tmp, double *b) {
+  int j;
+
+  for(j=plan.slice_start[p]+1; j<=plan.slice_start[p+1]; j++) {
+    copy(y, y + plan.M, y_prev);
+    if(j <= plan.rannacher) {
+      parareal_step(plan.M, plan.call_or_put, 1.0, plan.lw_half, plan.uw_half, plan.lo_mid[j], plan.hi_mid[j], plan.half, plan.obstacle, plan.ex_mid[j], y_prev, tmp, b);
+      parareal_step(plan.M, plan.call_or_put, 1.0, plan.lw_half, plan.uw_half, plan.lo_bc[j], plan.hi_bc[j], plan.half, plan.obstacle, plan.ex_bc[j], tmp, y, b);
+    } else {
+      parareal_step(plan.M, plan.call_or_put, plan.theta, plan.lw, plan.uw, plan.lo_bc[j], plan.hi_bc[j], plan.fine, plan.obstacle, plan.ex_bc[j], y_prev, y, b);
+    }
+  }
+}
+
+// end layer of coarse step s of slice p
+static int coarse_end(const parareal_plan &plan, int p, int s) {
+  int j0 = plan.slice_start[p], len = plan.slice_start[p+1] - j0;
+
+  return j0 + (int)((long)len*(s+1)/plan.coarse_steps);
+}
+
+// coarse propagator of slice p: coarse_steps steps over the whole slice from y_from, tmp is scratch space of length M
+static void coarse_slice(const parareal_plan &plan, int p, const double *y_from, double *y_to, double *tmp, double *b) {
+  int s, j = plan.slice_start[p], j_next;
+  const double *from = y_from;
+
+  for(s=0; s<plan.coarse_steps; s++) {
+    j_next = coarse_end(plan, p, s);
+    if(j_next == j) continue;
+    // the last step lands in y_to; before it the layers alternate so that none is read while written
+    double *to = (((plan.coarse_steps - 1 - s) & 1) == 0) ? y_to : tmp;
+    const coarse_operator &op = plan.coarse.at(j_next - j);
+
+    parareal_step(plan.M, plan.call_or_put, plan.coarse_theta, op.lw.data(), op.uw.data(), plan.lo_bc[j_next], plan.hi_bc[j_next], &op.f, plan.obstacle, plan.ex_bc[j_next], from, to, b);
+    from = to;
+    j = j_next;
+  }
+  if(from != y_to) copy(from, from + plan.M, y_to);
+}
+
+/**
+ * Solves Black Scholes equation with the theta scheme, parallel in time (Parareal)
+ *   The N-1 steps of the march are cut into P slices. A coarse propagator G, ctl->coarse_steps
+ *   steps of ctl->coarse_theta over each slice, sweeps serially over the slices; the fine
+ *   propagator F, the steps of the theta scheme themselves, runs every slice at once from the
+ *   current guess of its start layer. Iteration k corrects
+ *     U[p+1] = F(U_old[p]) + (G(U[p]) - G(U_old[p]))
+ *   so the first k slice ends are exact after k iterations, and after P the result is the serial
+ *   march bit for bit. Iterations stop earlier once no slice end layer moves by more than
+ *   ctl->tol relative to the largest value of the layer.
+ *   The coarse steps use the fine obstacle and fine boundary rows (weights theta*lw/coarse_theta,
+ *   theta*uw/coarse_theta) so G and F differ in the interior only. A single Crank-Nicholson step
+ *   over a whole slice barely damps the stiff modes and the iteration diverges; with 16 steps per
+ *   slice it converges in 3 to 5 iterations, and the coarse sweep still costs little next to a
+ *   slice. On a non-uniform grid (opts->grid) the nodes clustered at the strike make the coarse
+ *   weights far larger than 1, where even 16 CN steps do not damp and the iteration runs to all
+ *   P slices; the coarse steps there are implicit whatever ctl->coarse_theta, which converges in
+ *   about 5 iterations for any P.
+ *   When the iterations stop on tol, the last slice is marched once more from its final start
+ *   layer, so the final layer and the one before it, which give the greeks, are one fine step
+ *   apart as in the serial march.
+ *   Spot and strike ladders and the greeks of opts->result are filled; snapshots, the expiry
+ *   strip and bump_greeks need every layer of the serial march and are ignored. The fine steps
+ *   of each slice are Thomas solves, the slices being the parallelism, so solver_threads is
+ *   not used either.
+ * Inputs: double theta (weight of the implicit part of the fine scheme, 0 <= theta <= 1)
+ *         double S, K, r, q, sigma, expiry, dx, dtau, int call_or_put, amer_or_eur (as for the engines)
+ *         const FDM_options *opts (optional, as above)
+ *         FDM_parareal_control *ctl (optional, settings and statistics, defaults when null)
+ * Output: double value (value of option)
+ */
+double parareal_fdm(double theta, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts, FDM_parareal_control *ctl) {
+  FDM_parareal_control local_ctl;
+  FDM_tridiag_factor local_fine, local_half;
+  parareal_plan plan;
+  double w, t_max, tau, lo_growth, hi_growth, lo_half_growth, hi_half_growth, ex_growth, ex_half_growth, change, scale;
+  int i, j, k, p, M, N, P, n_threads, iter, first;
+  long fine_steps;
+
+  if(ctl == 0) ctl = &local_ctl;
+
+  double rp = 2*r/(sigma*sigma);
+  double qp = 2*(r-q)/(sigma*sigma);
+  double alpha = -0.5*(qp-1);
+  double beta = -0.25*(qp-1)*(qp-1) - rp;
+
+  // x = log(S/K) from -2.5 to 2.5, or the grid of opts; tau from 0 to 0.5*sigma^2*expiry
+  M = 1 + ((2.5 - (-2.5))/dx);
+  if(opts != 0 && opts->grid != 0) M = opts->n_grid;
+  vector<double> x(M);
+  for(i=0; i<M; i++) {
+    x[i] = (opts != 0 && opts->grid != 0) ? opts->grid[i] : -2.5 + i*dx;
+  }
+  t_max = 0.5*(sigma*sigma)*expiry;
+  N = 1 + (t_max/dtau);
+  w = dtau/(dx*dx);
+
+  n_threads = partition_threads(ctl->threads);
+  P = max(1, min((ctl->slices > 0) ? ctl->slices : n_threads, N-1));
+
+  vector<double> lw(M), uw(M), lw_half(M), uw_half(M), obstacle(M), y0(M);
+  if(opts != 0 && opts->grid != 0) {
+    grid_weights(M, x.data(), dtau, lw.data(), uw.data());
+  } else {
+    fill(lw.begin(), lw.end(), w);
+    fill(uw.begin(), uw.end(), w);
+  }
+  for(i=0; i<M; i++) {
+    obstacle[i] = call_or_put*(exp(0.5*x[i]*(qp+1))-exp(0.5*x[i]*(qp-1)));
+    y0[i] = fmax(obstacle[i],0.0); // Initial condition (at tau=0)
+    lw_half[i] = 0.5*lw[i];
+    uw_half[i] = 0.5*uw[i];
+  }
+
+  // boundary values of every layer, grown step by step as the serial march does, and the
+  // scale of the obstacle, the payoff being exp(-beta*tau)*payoff in y units
+  vector<double> lo_bc(N), hi_bc(N), lo_mid(N), hi_mid(N), ex_bc(N), ex_mid(N);
+  lo_growth = exp(0.25*(qp-1)*(qp-1)*dtau);
+  hi_growth = exp(0.25*(qp+1)*(qp+1)*dtau);
+  lo_half_growth = exp(0.25*(qp-1)*(qp-1)*0.5*dtau);
+  hi_half_growth = exp(0.25*(qp+1)*(qp+1)*0.5*dtau);
+  ex_growth = exp(-beta*dtau);
+  ex_half_growth = exp(-beta*0.5*dtau);
+  lo_bc[0] = exp(0.5*(qp-1)*x[0]);
+  hi_bc[0] = exp(0.5*(qp+1)*x[M-1]);
+  ex_bc[0] = 1.0;
+  for(j=1; j<N; j++) {
+    lo_mid[j] = lo_bc[j-1]*lo_half_growth;
+    hi_mid[j] = hi_bc[j-1]*hi_half_growth;
+    lo_bc[j] = lo_bc[j-1]*lo_growth;
+    hi_bc[j] = hi_bc[j-1]*hi_growth;
+    ex_mid[j] = ex_bc[j-1]*ex_half_growth;
+    ex_bc[j] = ex_bc[j-1]*ex_growth;
+  }
+
+  plan.M = M;
+  plan.N = N;
+  plan.call_or_put = call_or_put;
+  plan.theta = theta;
+  plan.rannacher = (opts != 0 && theta > 0.0 && theta < 1.0) ? min(opts->rannacher_steps, N-1) : 0;
+  plan.lw = lw.data();
+  plan.uw = uw.data();
+  plan.lw_half = lw_half.data();
+  plan.uw_half = uw_half.data();
+  plan.lo_bc = lo_bc.data();
+  plan.hi_bc = hi_bc.data();
+  plan.lo_mid = lo_mid.data();
+  plan.hi_mid = hi_mid.data();
+  plan.ex_bc = ex_bc.data();
+  plan.ex_mid = ex_mid.data();
+  plan.obstacle = (amer_or_eur == 1) ? obstacle.data() : 0;
+  plan.fine = (theta > 0.0) ? heat_operator(opts, M, w, dtau, theta, &local_fine) : 0;
+  plan.half = 0;
+  if(plan.rannacher > 0) {
+    vector<double> a(3*M);
+
+    heat_operator_matrix(M, lw_half.data(), uw_half.data(), 1.0, a.data());
+    tridiag_factor(M, a.data(), &local_half);
+    plan.half = &local_half;
+  }
+
+  // slices of near equal length, cut into coarse steps whose boundary rows are those of the fine ones
+  plan.slice_start.resize(P+1);
+  for(p=0; p<=P; p++) {
+    plan.slice_start[p] = (int)((long)(N-1)*p/P);
+  }
+  plan.coarse_steps = max(1, ctl->coarse_steps);
+  plan.coarse_theta = (opts != 0 && opts->grid != 0) ? 1.0 : ctl->coarse_theta;
+  for(p=0; p<P; p++) {
+    for(k=0, j=plan.slice_start[p]; k<plan.coarse_steps; k++) {
+      int steps = coarse_end(plan, p, k) - j;
+
+      j += steps;
+      if(steps == 0 || plan.coarse.count(steps) > 0) continue;
+      coarse_operator &op = plan.coarse[steps];
+      vector<double> a(3*M);
+
+      op.lw.resize(M);
+      op.uw.resize(M);
+      for(i=0; i<M; i++) {
+        op.lw[i] = steps*lw[i];
+        op.uw[i] = steps*uw[i];
+      }
+      // boundary rows as in the fine step
+      for(int edge : {0, M-1}) {
+        op.lw[edge] = ((theta > 0.0) ? theta : 1.0)*lw[edge]/plan.coarse_theta;
+        op.uw[edge] = ((theta > 0.0) ? theta : 1.0)*uw[edge]/plan.coarse_theta;
+      }
+      heat_operator_matrix(M, op.lw.data(), op.uw.data(), plan.coarse_theta, a.data());
+      tridiag_factor(M, a.data(), &op.f);
+    }
+  }
+
+  // U[p] start layer of slice p, F[p] / G[p] fine and coarse image of the last U[p]
+  vector<vector<double> > U(P+1, vector<double>(M)), F(P, vector<double>(M)), G(P, vector<double>(M));
+  vector<vector<double> > prev(P, vector<double>(M)), tmp(P, vector<double>(M)), scratch(P, vector<double>(M));
+  vector<double> g_new(M), g_tmp(M), b(M);
+
+  U[0] = y0;
+  for(p=0; p<P; p++) {
+    coarse_slice(plan, p, U[p].data(), G[p].data(), g_tmp.data(), b.data());
+    U[p+1] = G[p];
+  }
+
+  ctl->iterations = 0;
+  ctl->converged = 0;
+  ctl->critical_steps = (long)P*plan.coarse_steps;
+  fine_steps = 0;
+  int max_iter = (ctl->max_iter > 0) ? min(ctl->max_iter, P) : P;
+
+  // fine runs of the slices from next on, taken one at a time by the caller and the team, which
+  // is started once and woken for every iteration by a move of generation
+  atomic<int> next(P);
+  auto run = [&]() {
+    int s;
+
+    while((s = next.fetch_add(1)) < P) {
+      F[s] = U[s];
+      fine_slice(plan, s, F[s].data(), prev[s].data(), tmp[s].data(), scratch[s].data());
+    }
+  };
+  mutex team_lock;
+  condition_variable start_cv, done_cv;
+  long generation = 0;
+  int finished = 0;
+  bool stopping = false;
+  vector<thread> team;
+  for(k=1; k<min(n_threads, P); k++) {
+    team.push_back(thread([&]() {
+      long seen = 0;
+
+      for(;;) {
+        {
+          unique_lock<mutex> guard(team_lock);
+          start_cv.wait(guard, [&] { return stopping || generation != seen; });
+          if(stopping) return;
+          seen = generation;
+        }
+        run();
+        {
+          lock_guard<mutex> guard(team_lock);
+          finished++;
+        }
+        done_cv.notify_one();
+      }
+    }));
+  }
+
+  for(iter=1; iter<=max_iter; iter++) {
+    // fine runs of the slices not yet exact, spread over the threads
+    first = iter - 1;
+    next.store(first);
+    {
+      lock_guard<mutex> guard(team_lock);
+      finished = 0;
+      generation++;
+    }
+    start_cv.notify_all();
+    run();
+    {
+      unique_lock<mutex> guard(team_lock);
+      done_cv.wait(guard, [&] { return finished == (int)team.size(); });
+    }
+
+    // serial coarse correction sweep
+    change = 0.0;
+    scale = 1.0;
+    for(p=first; p<P; p++) {
+      // the start layer of the first slice did not change, nor does its coarse image
+      if(p == first) g_new = G[p];
+      else coarse_slice(plan, p, U[p].data(), g_new.data(), g_tmp.data(), b.data());
+      for(i=0; i<M; i++) {
+        double u = F[p][i] + (g_new[i] - G[p][i]);
+
+        change = max(change, fabs(u - U[p+1][i]));
+        scale = max(scale, fabs(u));
+        U[p+1][i] = u;
+      }
+      G[p] = g_new;
+    }
+
+    for(p=first; p<P; p++) {
+      fine_steps = max(fine_steps, (long)(plan.slice_start[p+1] - plan.slice_start[p] + ((plan.slice_start[p] < plan.rannacher) ? plan.rannacher - plan.slice_start[p] : 0)));
+    }
+    ctl->critical_steps += fine_steps + (long)(P - first - 1)*plan.coarse_steps;
+    fine_steps = 0;
+    ctl->iterations = iter;
+    ctl->max_change = change;
+    if(change <= ctl->tol*scale) {
+      ctl->converged = 1;
+      break;
+    }
+  }
+  if(iter > max_iter && max_iter == P) ctl->converged = 1; // exact after P iterations
+  {
+    lock_guard<mutex> guard(team_lock);
+    stopping = true;
+  }
+  start_cv.notify_all();
+  for(k=0; k<(int)team.size(); k++) {
+    team[k].join();
+  }
+
+  // the last fine run of the final slice started from an earlier guess of U[P-1] unless the
+  // iteration ran to the end; march it again so y_prev and y come from the final U[P-1]
+  first = min(iter, max_iter) - 1;
+  if(N > 1 && first < P-1) {
+    U[P] = U[P-1];
+    fine_slice(plan, P-1, U[P].data(), prev[P-1].data(), tmp[P-1].data(), scratch[P-1].data());
+    ctl->critical_steps += plan.slice_start[P] - plan.slice_start[P-1] + ((plan.slice_start[P-1] < plan.rannacher) ? plan.rannacher - plan.slice_start[P-1] : 0);
+  }
+  ctl->model_speedup = (double)(N-1 + plan.rannacher)/ctl->critical_steps;
+
+  // value of the option at x = log(S/K) on the final layer, ladders and greeks as in the serial march
+  j = N-1;
+  tau = j*dtau;
+  const double *y = U[P].data();
+  const double *y_prev = (N > 1) ? prev[P-1].data() : y;
+  double value = value_at_spot(S, K, alpha, beta*tau, M, x.data(), y);
+  store_spot_values(opts, K, alpha, beta*tau, M, x.data(), y);
+  store_strike_values(opts, S, alpha, beta*tau, M, x.data(), y);
+  store_greeks(opts, S, K, sigma, alpha, beta, tau, (j>0)?tau-dtau:tau, M, x.data(), y, y_prev);
+
+  for(auto &op : plan.coarse) {
+    tridiag_factor_free(&op.second.f);
+  }
+  tridiag_factor_free(&local_fine);
+  tridiag_factor_free(&local_half);
+  return value;
+}
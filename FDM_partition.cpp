@@ -0,0 +1,364 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Partitioned (SPIKE) tridiagonal solver for very fine grids, its blocks solved side by side in one thread
+*              and spread over a team of threads.
+*
+* */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FDM_utils.h"
+
+using namespace std;
+
+#define PARTITION_LANES 4        // blocks marched side by side by each thread
+#define PARTITION_MIN_BLOCK 256  // fewer rows per block cost more in the interface system than they save
+#define PARTITION_SPIN_US 50     // a worker idle this long sleeps until the next phase
+
+/**
+ * Threads that stay alive for as long as the factorization and run one phase of every solve.
+ * Worker t handles the blocks of slice t, the calling thread slice 0. A phase starts when the
+ * generation counter moves and ends when every worker has counted itself done. The caller spins,
+ * yielding, for the end of a phase, which lasts only microseconds; a worker spins the same way
+ * for PARTITION_SPIN_US, enough for the next phase of the same solve, then sleeps on wake, so
+ * the team does not hold cores between solves or while the caller does other work.
+ */
+struct FDM_partition_team {
+  vector<thread> threads;
+  atomic<long> generation{0};
+  atomic<int> done{0};
+  atomic<bool> stopping{false};
+  mutex lock;                    // guards the moves of generation and stopping seen by sleepers
+  condition_variable wake;
+  int phase = 0;                 // 0 local solves, 1 corrections
+  FDM_partition_factor *f = 0;
+  const double *b = 0;
+  double *x = 0;
+};
+
+// the local solve of blocks [k0, k1) on their own, x = A_k^-1 b_k, the blocks marched in lockstep
+static void partition_local(const FDM_partition_factor *f, int k0, int k1, const double *b, double *x) {
+  const double *lower = f->lower, *upper = f->upper, *inv_pivot = f->inv_pivot;
+  int L = f->block, last = f->n_blocks - 1, end = f->n - 1;
+  int i, k, idx;
+
+  for(k=k0; k<k1; k++) {
+    x[k*L] = b[k*L];
+  }
+  // forward substitution; the lower multiplier of a block's first row is zero
+  for(i=1; i<L; i++) {
+    for(k=k0; k<k1; k++) {
+      idx = k*L + i;
+      x[idx] = b[idx] - lower[idx]*x[idx-1];
+    }
+  }
+  // the last block also takes the rows beyond n_blocks*block
+  if(k1 == last+1) {
+    for(idx=last*L + L; idx<=end; idx++) {
+      x[idx] = b[idx] - lower[idx]*x[idx-1];
+    }
+    for(idx=end; idx>=last*L + L; idx--) {
+      x[idx] = (idx < end) ? (x[idx] - upper[idx]*x[idx+1])*inv_pivot[idx] : x[idx]*inv_pivot[idx];
+    }
+  }
+  // backward substitution, the last row of a block has no coupling inside it
+  for(k=k0; k<k1; k++) {
+    idx = k*L + L-1;
+    if(k == last && idx < end) x[idx] = (x[idx] - upper[idx]*x[idx+1])*inv_pivot[idx];
+    else x[idx] = x[idx]*inv_pivot[idx];
+  }
+  for(i=L-2; i>=0; i--) {
+    for(k=k0; k<k1; k++) {
+      idx = k*L + i;
+      x[idx] = (x[idx] - upper[idx]*x[idx+1])*inv_pivot[idx];
+    }
+  }
+}
+
+// the interface unknowns x[e_k], x[s_k+1] of the local solutions in x, by block Thomas on the 2x2 blocks
+static void partition_interfaces(FDM_partition_factor *f, double *x) {
+  const double *g;
+  double *r = f->rhs;
+  int L = f->block, P = f->n_blocks, k;
+  double r0, r1;
+
+  // forward: only the first row of each interface is coupled to the one before
+  for(k=0; k<P-1; k++) {
+    r[2*k] = x[k*L + L-1];
+    r[2*k+1] = x[(k+1)*L];
+    if(k > 0) {
+      g = f->reduced + 6*(k-1);
+      r[2*k] -= f->reduced[6*k+4]*(g[0]*r[2*k-2] + g[1]*r[2*k-1]);
+    }
+  }
+  // backward: only the second row of each interface is coupled to the one after
+  for(k=P-2; k>=0; k--) {
+    g = f->reduced + 6*k;
+    r0 = r[2*k];
+    r1 = r[2*k+1];
+    if(k < P-2) r1 -= g[5]*r[2*(k+1)+1];
+    r[2*k] = g[0]*r0 + g[1]*r1;
+    r[2*k+1] = g[2]*r0 + g[3]*r1;
+  }
+}
+
+// x = z - spike_left*x[s_k-1] - spike_right*x[e_k+1] over blocks [k0, k1), the interface values taken from f->rhs
+static void partition_correct(const FDM_partition_factor *f, int k0, int k1, double *x) {
+  const double *v = f->spike_left, *w = f->spike_right;
+  int L = f->block, last = f->n_blocks - 1;
+  int i, k, s, e;
+  double left, right;
+
+  for(k=k0; k<k1; k++) {
+    s = k*L;
+    e = (k == last) ? f->n : s + L;
+    left = (k > 0) ? f->rhs[2*(k-1)] : 0.0;
+    right = (k < last) ? f->rhs[2*k+1] : 0.0;
+    for(i=s; i<e; i++) {
+      x[i] -= v[i]*left + w[i]*right;
+    }
+  }
+}
+
+// blocks of slice t of the team
+static void slice_blocks(const FDM_partition_factor *f, int t, int *k0, int *k1) {
+  *k0 = (int)((long)f->n_blocks*t/f->n_threads);
+  *k1 = (int)((long)f->n_blocks*(t+1)/f->n_threads);
+}
+
+static void team_phase(FDM_partition_team *team, int t) {
+  int k0, k1;
+
+  // a team kept in a workspace may be larger than the factorization it solves with
+  if(t >= team->f->n_threads) return;
+  slice_blocks(team->f, t, &k0, &k1);
+  if(team->phase == 0) partition_local(team->f, k0, k1, team->b, team->x);
+  else partition_correct(team->f, k0, k1, team->x);
+}
+
+static void team_worker(FDM_partition_team *team, int t) {
+  chrono::steady_clock::time_point idle;
+  long seen = 0;
+
+  for(;;) {
+    idle = chrono::steady_clock::now();
+    while(team->generation.load(memory_order_acquire) == seen) {
+      if(team->stopping.load(memory_order_acquire)) return;
+      if(chrono::steady_clock::now() - idle > chrono::microseconds(PARTITION_SPIN_US)) {
+        unique_lock<mutex> guard(team->lock);
+        team->wake.wait(guard, [&] { return team->generation.load(memory_order_acquire) != seen || team->stopping.load(memory_order_acquire); });
+        continue;
+      }
+      this_thread::yield();
+    }
+    seen++;
+    team_phase(team, t);
+    team->done.fetch_add(1, memory_order_acq_rel);
+  }
+}
+
+// runs one phase on every slice and waits for the workers
+static void team_run(FDM_partition_team *team, int phase) {
+  int workers = (int)team->threads.size();
+
+  team->phase = phase;
+  team->done.store(0, memory_order_relaxed);
+  {
+    lock_guard<mutex> guard(team->lock);
+    team->generation.fetch_add(1, memory_order_acq_rel);
+  }
+  team->wake.notify_all();
+  team_phase(team, 0);
+  while(team->done.load(memory_order_acquire) < workers) {
+    this_thread::yield();
+  }
+}
+
+// a team of n_threads with the caller, its workers waiting for the first phase
+static FDM_partition_team* team_start(int n_threads) {
+  FDM_partition_team *team = new FDM_partition_team();
+
+  for(int t=1; t<n_threads; t++) {
+    team->threads.push_back(thread(team_worker, team, t));
+  }
+  return team;
+}
+
+/**
+ * Stops and joins the workers of a team and releases it (nothing for a null team)
+ */
+void partition_team_free(FDM_partition_team *team) {
+  if(team == 0) return;
+  {
+    lock_guard<mutex> guard(team->lock);
+    team->stopping.store(true, memory_order_release);
+  }
+  team->wake.notify_all();
+  for(size_t k=0; k<team->threads.size(); k++) {
+    team->threads[k].join();
+  }
+  delete team;
+}
+
+/**
+ * Threads to give a partitioned solve: the number requested, or with 0 every hardware thread
+ */
+int partition_threads(int requested) {
+  if(requested > 0) return requested;
+  return max(1, (int)thread::hardware_concurrency());
+}
+
+/**
+ * Partitioned (SPIKE) factorization of a tridiagonal matrix
+ *   The rows are split into P blocks of PARTITION_LANES per thread, each factorized on its own.
+ *   The coupling of block k to its neighbours is carried by two spikes, the columns
+ *   A_k^-1 (sub[s_k] e_first) and A_k^-1 (sup[e_k] e_last), so the solution is
+ *     x_k = z_k - spike_left_k x[s_k-1] - spike_right_k x[e_k+1],  z_k = A_k^-1 b_k
+ *   and only the 2(P-1) values next to the block edges need a system of their own, block
+ *   tridiagonal in 2x2 blocks, which is factorized here as well. A solve then costs a local
+ *   solve and a correction pass per block (both independent between blocks, the correction
+ *   vectorizes) and an O(P) interface solve.
+ *   With fewer than PARTITION_MIN_BLOCK rows per block the blocks are made larger.
+ *   No pivoting, as for tridiag_factor: the matrix must be diagonally dominant, as the heat
+ *   operator is.
+ * Inputs : int n (number of points in space)
+ *          double* a (length=3*n), stores tridiagonal matrix
+ *          int n_threads (threads of each solve, see partition_threads)
+ *          FDM_workspace* ws (optional), whose team is used, started or enlarged as needed, so
+ *          that it outlives f; without it f starts a team of its own
+ * Output : FDM_partition_factor* f, free with partition_factor_free (before workspace_free of ws)
+ */
+void partition_factor(int n, const double *a, int n_threads, FDM_partition_factor *f, FDM_workspace *ws) {
+  int i, k, s, e, L, P;
+  double pivot, *g, d00, d01, d10, d11, det;
+
+  partition_factor_free(f);
+  P = max(1, min(n_threads*PARTITION_LANES, n/PARTITION_MIN_BLOCK));
+  n_threads = max(1, min(n_threads, P));
+  L = n/P;
+
+  f->n = n;
+  f->n_blocks = P;
+  f->block = L;
+  f->n_threads = n_threads;
+  f->lower = new double[n];
+  f->upper = new double[n];
+  f->inv_pivot = new double[n];
+  f->spike_left = new double[n];
+  f->spike_right = new double[n];
+  f->reduced = new double[6*max(1, P-1)];
+  f->rhs = new double[2*max(1, P-1)];
+
+  // main diagonal is stored in a[3*i+1]
+  // sub diagonal is stored in a[3*i]
+  // sup diagonal is stored in a[3*i+2]
+  for(k=0; k<P; k++) {
+    s = k*L;
+    e = (k == P-1) ? n-1 : s+L-1;
+    pivot = a[3*s+1];
+    f->lower[s] = 0.0;
+    f->inv_pivot[s] = 1.0/pivot;
+    for(i=s+1; i<=e; i++) {
+      f->lower[i] = a[3*i]/pivot;
+      pivot = a[3*i+1] - a[3*(i-1)+2]*f->lower[i];
+      f->inv_pivot[i] = 1.0/pivot;
+    }
+    for(i=s; i<=e; i++) {
+      f->upper[i] = (i < e) ? a[3*i+2] : 0.0;
+    }
+
+    // spikes: local solves of the couplings to x[s-1] and x[e+1]
+    for(i=s; i<=e; i++) {
+      f->spike_left[i] = f->spike_right[i] = 0.0;
+    }
+    if(k > 0) f->spike_left[s] = a[3*s];
+    if(k < P-1) f->spike_right[e] = a[3*e+2];
+    for(i=s+1; i<=e; i++) {
+      f->spike_left[i] -= f->lower[i]*f->spike_left[i-1];
+      f->spike_right[i] -= f->lower[i]*f->spike_right[i-1];
+    }
+    f->spike_left[e] *= f->inv_pivot[e];
+    f->spike_right[e] *= f->inv_pivot[e];
+    for(i=e-1; i>=s; i--) {
+      f->spike_left[i] = (f->spike_left[i] - f->upper[i]*f->spike_left[i+1])*f->inv_pivot[i];
+      f->spike_right[i] = (f->spike_right[i] - f->upper[i]*f->spike_right[i+1])*f->inv_pivot[i];
+    }
+  }
+
+  // interface k holds (x[e_k], x[s_k+1]):
+  //   x[e_k] + spike_left[e_k] x[e_k-1 interface] + spike_right[e_k] x[s_k+1] = z[e_k]
+  //   x[s_k+1] + spike_left[s_k+1] x[e_k] + spike_right[s_k+1] x[s_k+2] = z[s_k+1]
+  // stored as the inverse of the eliminated diagonal block (4), the coupling to the interface
+  // before (first row) and to the one after (second row)
+  for(k=0; k<P-1; k++) {
+    g = f->reduced + 6*k;
+    e = k*L + L-1;
+    s = (k+1)*L;
+    d00 = 1.0;
+    d01 = f->spike_right[e];
+    d10 = f->spike_left[s];
+    d11 = 1.0;
+    g[4] = f->spike_left[e];
+    g[5] = f->spike_right[s];
+    if(k > 0) d01 -= g[4]*f->reduced[6*(k-1)+5]*f->reduced[6*(k-1)+1];
+    det = d00*d11 - d01*d10;
+    g[0] = d11/det;
+    g[1] = -d01/det;
+    g[2] = -d10/det;
+    g[3] = d00/det;
+  }
+
+  if(n_threads > 1 && ws != 0) {
+    if(ws->team == 0 || (int)ws->team->threads.size() + 1 < n_threads) {
+      partition_team_free(ws->team);
+      ws->team = team_start(n_threads);
+    }
+    f->team = ws->team;
+    f->shared_team = 1;
+  } else if(n_threads > 1) {
+    f->team = team_start(n_threads);
+  }
+}
+
+void partition_factor_free(FDM_partition_factor *f) {
+  if(f->shared_team == 0) partition_team_free(f->team);
+  f->team = 0;
+  f->shared_team = 0;
+  delete [] f->lower;
+  delete [] f->upper;
+  delete [] f->inv_pivot;
+  delete [] f->spike_left;
+  delete [] f->spike_right;
+  delete [] f->reduced;
+  delete [] f->rhs;
+  f->lower = f->upper = f->inv_pivot = f->spike_left = f->spike_right = f->reduced = f->rhs = 0;
+  f->n = f->n_blocks = f->block = 0;
+  f->n_threads = 1;
+}
+
+/**
+ * Solves a*x = b with a factorization from partition_factor, on its team of threads if it has one
+ * Inputs : FDM_partition_factor* f (its interface scratch space is written, one solve at a time)
+ *          double* b (length=n), stores right hand side
+ * Output : double* x (length=n, must not alias b), where a*x = b
+ */
+void partition_solve(FDM_partition_factor *f, const double *b, double *x) {
+  if(f->team != 0) {
+    f->team->f = f;
+    f->team->b = b;
+    f->team->x = x;
+    team_run(f->team, 0);
+    partition_interfaces(f, x);
+    team_run(f->team, 1);
+  } else {
+    partition_local(f, 0, f->n_blocks, b, x);
+    partition_interfaces(f, x);
+    partition_correct(f, 0, f->n_blocks, x);
+  }
+}
@@ -0,0 +1,225 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: Per thread phase timers, SOR counters and hardware counters of the engines, dumped as JSON.
+*
+* */
+
+#include "FDM_profile.h"
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const char *phase_names[FDM_N_PHASES] = {
+  "grid_setup", "payoff", "rhs", "solve", "project", "interpolate"
+};
+
+// every thread profile ever created, kept until exit so a dump sees threads that have finished
+static mutex registry_lock;
+static vector<unique_ptr<FDM_thread_profile>> registry;
+static thread_local FDM_thread_profile *current = 0;
+
+static FDM_thread_profile *thread_profile() {
+  if(current == 0) {
+    lock_guard<mutex> guard(registry_lock);
+    registry.push_back(unique_ptr<FDM_thread_profile>(new FDM_thread_profile()));
+    current = registry.back().get();
+  }
+  return current;
+}
+
+long long profile_clock() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Records one SOR solve
+ * Inputs : int iterations (sweeps done), double residual (size of the last update),
+ *          int converged (0 if the solve stopped at its sweep limit)
+ */
+void profile_record_sor(int iterations, double residual, int converged) {
+  FDM_thread_profile *p = thread_profile();
+
+  p->sor_solves++;
+  p->sor_iterations += iterations;
+  if(iterations > p->sor_max_iterations) p->sor_max_iterations = iterations;
+  if(!converged) p->sor_unconverged++;
+  p->sor_residual_sum += residual;
+  if(residual > p->sor_residual_max) p->sor_residual_max = residual;
+}
+
+// opens a cycles + cache misses counter group for the calling thread, user space only
+static void open_counters(FDM_thread_profile *p) {
+  p->perf_tried = 1;
+#ifdef __linux__
+  struct perf_event_attr pe;
+  int leader, member;
+
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof(pe);
+  pe.config = PERF_COUNT_HW_CPU_CYCLES;
+  pe.read_format = PERF_FORMAT_GROUP;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  pe.disabled = 1;
+  leader = (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+  if(leader < 0) return;
+
+  pe.config = PERF_COUNT_HW_CACHE_MISSES;
+  pe.disabled = 0;
+  member = (int)syscall(__NR_perf_event_open, &pe, 0, -1, leader, 0);
+  if(member < 0) {
+    close(leader);
+    return;
+  }
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  p->perf_fd = leader;
+#endif
+}
+
+// current cycles and cache misses of the thread, 0 when there are no counters
+static void read_counters(const FDM_thread_profile *p, long long *cycles, long long *misses) {
+  *cycles = 0;
+  *misses = 0;
+#ifdef __linux__
+  struct { unsigned long long nr, values[2]; } data;
+
+  if(p->perf_fd >= 0 && read(p->perf_fd, &data, sizeof(data)) == (ssize_t)sizeof(data) && data.nr == 2) {
+    *cycles = (long long)data.values[0];
+    *misses = (long long)data.values[1];
+  }
+#endif
+}
+
+FDM_profile_call::FDM_profile_call() : profile(thread_profile()), start(0), start_cycles(0), start_misses(0), mark(0), open(-1) {
+  if(profile->depth++ > 0) return;
+  if(!profile->perf_tried) open_counters(profile);
+  read_counters(profile, &start_cycles, &start_misses);
+  start = profile_clock();
+}
+
+FDM_profile_call::~FDM_profile_call() {
+  long long cycles, misses;
+
+  phase_end();
+  if(--profile->depth > 0) return;
+  profile->call_ns += (double)(profile_clock() - start);
+  read_counters(profile, &cycles, &misses);
+  profile->cycles += cycles - start_cycles;
+  profile->cache_misses += misses - start_misses;
+  profile->calls++;
+}
+
+void FDM_profile_call::phase(FDM_phase next) {
+  long long now = profile_clock();
+
+  if(open >= 0) {
+    profile->phase_ns[open] += (double)(now - mark);
+    profile->phase_count[open]++;
+  }
+  open = next;
+  mark = now;
+}
+
+void FDM_profile_call::phase_end() {
+  if(open < 0) return;
+  profile->phase_ns[open] += (double)(profile_clock() - mark);
+  profile->phase_count[open]++;
+  open = -1;
+}
+
+/**
+ * Clears the counters of every thread; call it while no engine is running
+ */
+void profile_reset() {
+  lock_guard<mutex> guard(registry_lock);
+
+  for(size_t k=0; k<registry.size(); k++) {
+    FDM_thread_profile *p = registry[k].get();
+    int fd = p->perf_fd, tried = p->perf_tried, depth = p->depth;
+
+    *p = FDM_thread_profile();
+    p->perf_fd = fd;
+    p->perf_tried = tried;
+    p->depth = depth;
+  }
+}
+
+static void add_profile(FDM_thread_profile *sum, const FDM_thread_profile &p) {
+  int k;
+
+  sum->calls += p.calls;
+  sum->call_ns += p.call_ns;
+  sum->cycles += p.cycles;
+  sum->cache_misses += p.cache_misses;
+  for(k=0; k<FDM_N_PHASES; k++) {
+    sum->phase_ns[k] += p.phase_ns[k];
+    sum->phase_count[k] += p.phase_count[k];
+  }
+  sum->sor_solves += p.sor_solves;
+  sum->sor_iterations += p.sor_iterations;
+  if(p.sor_max_iterations > sum->sor_max_iterations) sum->sor_max_iterations = p.sor_max_iterations;
+  sum->sor_unconverged += p.sor_unconverged;
+  sum->sor_residual_sum += p.sor_residual_sum;
+  if(p.sor_residual_max > sum->sor_residual_max) sum->sor_residual_max = p.sor_residual_max;
+  if(p.perf_fd >= 0) sum->perf_fd = p.perf_fd;
+}
+
+static void write_profile(ostream &out, const FDM_thread_profile &p, const char *indent) {
+  int k;
+
+  out << "{\"calls\": " << p.calls << ", \"call_ns\": " << p.call_ns;
+  if(p.perf_fd >= 0) out << ", \"cycles\": " << p.cycles << ", \"cache_misses\": " << p.cache_misses;
+  out << ",\n" << indent << " \"phases\": {";
+  for(k=0; k<FDM_N_PHASES; k++) {
+    out << (k > 0 ? ", " : "") << '"' << phase_names[k] << "\": {\"ns\": " << p.phase_ns[k] << ", \"count\": " << p.phase_count[k] << '}';
+  }
+  out << "},\n" << indent << " \"sor\": {\"solves\": " << p.sor_solves << ", \"iterations\": " << p.sor_iterations
+      << ", \"iterations_per_solve\": " << (p.sor_solves > 0 ? (double)p.sor_iterations/p.sor_solves : 0.0)
+      << ", \"max_iterations\": " << p.sor_max_iterations << ", \"unconverged\": " << p.sor_unconverged
+      << ", \"mean_residual\": " << (p.sor_solves > 0 ? p.sor_residual_sum/p.sor_solves : 0.0)
+      << ", \"max_residual\": " << p.sor_residual_max << "}}";
+}
+
+/**
+ * Writes the profile of every thread and their sum as JSON; call it while no engine is running
+ */
+void profile_dump_json(ostream &out) {
+  lock_guard<mutex> guard(registry_lock);
+  FDM_thread_profile total;
+  size_t k;
+
+  for(k=0; k<registry.size(); k++) {
+    add_profile(&total, *registry[k]);
+  }
+
+  out << setprecision(10);
+#ifdef FDM_INSTRUMENT
+  out << "{\n  \"enabled\": true,\n";
+#else
+  out << "{\n  \"enabled\": false,\n";
+#endif
+  out << "  \"hardware_counters\": " << (total.perf_fd >= 0 ? "true" : "false") << ",\n";
+  out << "  \"total\": ";
+  write_profile(out, total, "  ");
+  out << ",\n  \"threads\": [";
+  for(k=0; k<registry.size(); k++) {
+    out << (k > 0 ? ",\n    " : "\n    ");
+    write_profile(out, *registry[k], "    ");
+  }
+  out << "\n  ]\n}\n";
+}
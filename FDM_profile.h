@@ -0,0 +1,79 @@
+#ifndef FDM_PROFILE_H
+#define FDM_PROFILE_H
+
+#include <ostream>
+
+/**
+ * Opt-in instrumentation of the engines, compiled in with -DFDM_INSTRUMENT (make profile).
+ * Without it the FDM_PROFILE_* macros expand to nothing and the hot paths are unchanged.
+ *
+ * Each thread accumulates into its own FDM_thread_profile:
+ *   time per phase of a solve (grid setup, payoff, right hand side, tridiagonal solve,
+ *   early exercise projection, final interpolation), the SOR sweeps and residuals of every
+ *   time step, and per engine call the wall time and, on Linux when perf_event_open is
+ *   permitted, the CPU cycles and cache misses. The hardware counters are read once per engine
+ *   call only; a read costs a system call, too much for the per step phases.
+ * ExplicitFDM solves no system; its solve phase is the early exercise projection alone.
+ * Calls nested in an engine call (the bumps of bump_greeks) add to the phases but are not
+ * counted as calls of their own; the outer call has no phase open while they run.
+ */
+enum FDM_phase {
+  PHASE_GRID_SETUP = 0,
+  PHASE_PAYOFF,
+  PHASE_RHS,
+  PHASE_SOLVE,
+  PHASE_PROJECT,
+  PHASE_INTERPOLATE,
+  FDM_N_PHASES
+};
+
+struct FDM_thread_profile {
+  long calls = 0;                       // outermost engine calls
+  double call_ns = 0.0;
+  long long cycles = 0;                 // hardware counters over the engine calls
+  long long cache_misses = 0;
+  double phase_ns[FDM_N_PHASES] = {};
+  long phase_count[FDM_N_PHASES] = {};
+  long sor_solves = 0;                  // sor_method and psor_method solves, one per time step
+  long sor_iterations = 0;
+  int sor_max_iterations = 0;
+  long sor_unconverged = 0;             // solves that stopped at their sweep limit
+  double sor_residual_sum = 0.0;        // size of the last update of each solve
+  double sor_residual_max = 0.0;
+  int depth = 0;                        // nesting of engine calls
+  int perf_fd = -1;                     // counter group of the thread, -1 when unavailable
+  int perf_tried = 0;
+};
+
+long long profile_clock();
+void profile_record_sor(int iterations, double residual, int converged);
+void profile_reset();
+void profile_dump_json(std::ostream &out);
+
+// times one engine call and its phases, with the hardware counters around it when available
+class FDM_profile_call {
+public:
+  FDM_profile_call();
+  ~FDM_profile_call();
+  void phase(FDM_phase next);  // closes the open phase, if any, and opens next
+  void phase_end();            // closes the open phase
+private:
+  FDM_thread_profile *profile;
+  long long start, start_cycles, start_misses, mark;
+  int open;                    // open phase, -1 if none
+};
+
+// the phases of a call follow one another: each FDM_PROFILE_PHASE closes the previous one
+#ifdef FDM_INSTRUMENT
+#define FDM_PROFILE_CALL() FDM_profile_call fdm_profile_call_
+#define FDM_PROFILE_PHASE(p) fdm_profile_call_.phase(p)
+#define FDM_PROFILE_PHASE_END() fdm_profile_call_.phase_end()
+#define FDM_PROFILE_SOR(iterations, residual, converged) profile_record_sor(iterations, residual, converged)
+#else
+#define FDM_PROFILE_CALL() ((void)0)
+#define FDM_PROFILE_PHASE(p) ((void)0)
+#define FDM_PROFILE_PHASE_END() ((void)0)
+#define FDM_PROFILE_SOR(iterations, residual, converged) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,361 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: long-running pricing server, the --serve command line mode, on stdin/stdout or a Unix-domain socket.
+*
+* */
+
+#include "FDM_server.h"
+#include "FDM_batch.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define FDM_UNIX_SOCKETS
+#endif
+
+using namespace std;
+
+// request counters and the latencies of the last FDM_LATENCY_WINDOW requests, shared by the connections
+class latency_stats {
+public:
+  latency_stats() : start(chrono::steady_clock::now()) {}
+
+  void record(double us, int n_contracts, int failed) {
+    lock_guard<mutex> guard(lock);
+    if(window.size() < FDM_LATENCY_WINDOW) window.push_back(us);
+    else window[next] = us;
+    next = (next + 1) % FDM_LATENCY_WINDOW;
+    requests++;
+    contracts += n_contracts;
+    errors += failed;
+    total_us += us;
+    max_us = max(max_us, us);
+  }
+
+  // the counters, with those of the surface cache and the size of the surface file if any, as one line of JSON, cleared afterwards when reset is set
+  string json(int threads, const FDM_surface_cache *cache, const FDM_surface_file *surfaces, int reset) {
+    lock_guard<mutex> guard(lock);
+    vector<double> sorted(window);
+    ostringstream out;
+
+    sort(sorted.begin(), sorted.end());
+    out << fixed << setprecision(1)
+        << "{\"requests\":" << requests << ",\"contracts\":" << contracts << ",\"errors\":" << errors
+        << ",\"threads\":" << threads
+        << ",\"uptime_s\":" << chrono::duration<double>(chrono::steady_clock::now() - start).count()
+        << ",\"mean_us\":" << ((requests > 0) ? total_us/requests : 0.0)
+        << ",\"p50_us\":" << percentile(sorted, 0.50) << ",\"p99_us\":" << percentile(sorted, 0.99)
+        << ",\"max_us\":" << max_us;
+    if(cache != 0) {
+      FDM_cache_stats cs = cache->stats();
+      out << ",\"cache_hits\":" << cs.hits << ",\"cache_misses\":" << cs.misses << ",\"cache_evictions\":" << cs.evictions
+          << ",\"cache_entries\":" << cs.entries << ",\"cache_mb\":" << cs.bytes/1048576.0;
+    }
+    if(surfaces != 0) out << ",\"surfaces\":" << surfaces->size();
+    out << "}";
+    if(reset) {
+      window.clear();
+      next = 0;
+      requests = contracts = errors = 0;
+      total_us = max_us = 0.0;
+      start = chrono::steady_clock::now();
+    }
+    return out.str();
+  }
+
+private:
+  // nearest rank percentile of sorted latencies, 0 when there are none
+  static double percentile(const vector<double> &sorted, double p) {
+    if(sorted.empty()) return 0.0;
+    size_t rank = (size_t)ceil(p*sorted.size());
+    return sorted[(rank > 0) ? rank-1 : 0];
+  }
+
+  mutex lock;
+  vector<double> window;
+  size_t next = 0;
+  long requests = 0, contracts = 0, errors = 0;
+  double total_us = 0.0, max_us = 0.0;
+  chrono::steady_clock::time_point start;
+};
+
+// what a request adds to the counters, recorded once its reply is written
+struct request_record {
+  int timed = 0;       // price and greeks requests, including those answered with an error
+  int contracts = 0;
+  int failed = 0;
+};
+
+struct server_state {
+  FDM_batch_pricer pricer;
+  mutex pricer_lock;   // one request on the pool at a time, its contracts spread over the threads
+  latency_stats stats;
+  FDM_surface_cache *cache = 0;
+  const FDM_surface_file *surfaces = 0;
+  double dx, dtau;
+
+  server_state(int n_threads, double dx, double dtau) : pricer(n_threads), dx(dx), dtau(dtau) {}
+};
+
+/**
+ * Answers one request line
+ * Inputs: server_state *server (pricer, counters and grid)
+ *         string line (request, without the newline)
+ * Output: string *reply (reply line, without the newline)
+ *         request_record *record (to pass to record_request after the reply is written)
+ *         bool (false when the session ends)
+ */
+static bool handle_request(server_state *server, const string &line, string *reply, request_record *record) {
+  string command, body, field;
+  size_t split = line.find(' ');
+  vector<FDM_contract> contracts;
+  FDM_contract c;
+  ostringstream out;
+
+  command = line.substr(0, split);
+  body = (split == string::npos) ? "" : line.substr(split+1);
+  if(!command.empty() && command.back() == '\r') command.pop_back();
+
+  if(command == "quit") return false;
+  if(command == "stats") {
+    *reply = server->stats.json(server->pricer.threads(), server->cache, server->surfaces, body.compare(0, 5, "reset") == 0);
+    return true;
+  }
+  if(command != "price" && command != "greeks") {
+    *reply = "error unknown command " + command;
+    return true;
+  }
+
+  stringstream ss(body);
+  while(getline(ss, field, ';')) {
+    string number = "error contract " + to_string(contracts.size()+1) + ": ";
+    if(!parse_contract(field, &c)) {
+      *reply = number + "expected S,K,r,q,sigma,T,call|put,european|american,method with finite numbers and S, K, sigma, T > 0";
+      *record = {1, 0, 1};
+      return true;
+    }
+    // M*N as in the engines, so one contract cannot hold the pool for long or allocate without bound
+    if(c.method != METHOD_BLACK_SCHOLES &&
+       (1 + 5.0/server->dx)*(1 + 0.5*c.sigma*c.sigma*c.expiry/server->dtau) > (double)FDM_SERVER_MAX_NODES) {
+      *reply = number + "sigma^2*T too large for the grid of the server, more than " + to_string(FDM_SERVER_MAX_NODES) + " nodes";
+      *record = {1, 0, 1};
+      return true;
+    }
+    contracts.push_back(c);
+  }
+
+  out << "ok " << setprecision(10);
+  try {
+    if(command == "price") {
+      vector<double> values(contracts.size());
+      {
+        lock_guard<mutex> guard(server->pricer_lock);
+        server->pricer.price((int)contracts.size(), contracts.data(), server->dx, server->dtau, values.data());
+      }
+      for(size_t i=0; i<values.size(); i++) {
+        out << (i > 0 ? ";" : "") << values[i];
+      }
+    } else {
+      vector<FDM_result> results(contracts.size());
+      {
+        lock_guard<mutex> guard(server->pricer_lock);
+        server->pricer.price_greeks((int)contracts.size(), contracts.data(), server->dx, server->dtau, results.data());
+      }
+      for(size_t i=0; i<results.size(); i++) {
+        const FDM_result &res = results[i];
+        out << (i > 0 ? ";" : "") << res.price << ',' << res.delta << ',' << res.gamma << ',' << res.theta << ',' << res.vega << ',' << res.rho;
+      }
+    }
+  } catch(const exception &e) {
+    // the pool rethrows what a contract threw; the other connections keep being served
+    *reply = string("error ") + e.what();
+    *record = {1, 0, 1};
+    return true;
+  }
+  *reply = out.str();
+  *record = {1, (int)contracts.size(), 0};
+  return true;
+}
+
+// adds a request read at start to the counters, once its reply has been written
+static void record_request(server_state *server, const request_record &record, chrono::steady_clock::time_point start) {
+  if(record.timed) {
+    server->stats.record(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count(), record.contracts, record.failed);
+  }
+}
+
+#ifdef FDM_UNIX_SOCKETS
+// serves one client of the socket until it quits or disconnects
+static void serve_connection(server_state *server, int fd) {
+  string pending, reply;
+  char buffer[65536];
+  ssize_t got;
+  size_t end;
+  bool open = true, too_long = false;
+
+  // writes reply and its newline whole, false once the client is gone
+  auto send_reply = [&]() {
+    reply += '\n';
+    for(size_t sent=0; sent<reply.size(); ) {
+      ssize_t n = write(fd, reply.data()+sent, reply.size()-sent);
+      if(n <= 0) return false;
+      sent += n;
+    }
+    return true;
+  };
+
+  while(open && (got = read(fd, buffer, sizeof(buffer))) > 0) {
+    pending.append(buffer, got);
+    while(open && (end = pending.find('\n')) != string::npos) {
+      string line = pending.substr(0, end);
+      pending.erase(0, end+1);
+      // the rest of a line already answered as too long
+      if(too_long) {
+        too_long = false;
+        continue;
+      }
+      if(line.empty()) continue;
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      request_record record;
+      open = handle_request(server, line, &reply, &record);
+      if(!open) break;
+      open = send_reply();
+      record_request(server, record, start);
+    }
+    // a line without its newline is dropped once it outgrows FDM_SERVER_MAX_LINE, and answered
+    // once; what follows up to the next newline is dropped with it
+    if(open && pending.size() > FDM_SERVER_MAX_LINE) {
+      pending.clear();
+      if(!too_long) {
+        too_long = true;
+        reply = "error request longer than " + to_string(FDM_SERVER_MAX_LINE) + " bytes";
+        open = send_reply();
+      }
+    }
+  }
+  close(fd);
+}
+
+// accepts clients on a Unix-domain socket at path, one thread per connection
+static int serve_socket(server_state *server, const char *path) {
+  struct sockaddr_un addr;
+  int listener, fd;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "socket path too long: " << path << endl;
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN); // a client gone mid-reply must not end the server
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if(listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+    cerr << "cannot listen on " << path << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  cerr << "serving on " << path << " with " << server->pricer.threads() << " threads" << endl;
+
+  while((fd = accept(listener, 0, 0)) >= 0 || errno == EINTR) {
+    if(fd >= 0) thread(serve_connection, server, fd).detach();
+  }
+  cerr << "accept failed: " << strerror(errno) << endl;
+  close(listener);
+  return 1;
+}
+#endif
+
+/**
+ * Command line server mode:
+ *   ./FDM --serve [--socket path] [--threads n] [--dx 0.05] [--dtau 0.00125] [--cache-mb n] [--surfaces file]
+ * Without --socket the requests are read from stdin and the replies written to stdout, one line
+ * each (see FDM_server.h for the protocol). All requests are priced on the grid (dx, dtau), so every
+ * worker factors the implicit and CN matrices once, before the first request. A grid that is not
+ * finite and positive, or outside 4 to FDM_SERVER_MAX_NODES points in space, is refused at startup.
+ * With --cache-mb the price requests are read from a cache of final layers of at most n MB
+ * (see FDM_surface_cache), and stats also reports its hits and misses.
+ * With --surfaces the price requests are first looked up in a surface file written by the batch
+ * mode (--save-surfaces), mapped at startup, so the book of the last run is answered without a solve.
+ */
+int server_main(int argc, char **argv) {
+  const char *socket_path = 0, *surfaces_path = 0;
+  int n_threads = 0, k;
+  double dx = 0.05, dtau = 0.00125, cache_mb = 0.0;
+  string line, reply;
+
+  for(k=1; k<argc; k++) {
+    if(strcmp(argv[k], "--serve") == 0) continue;
+    else if(strcmp(argv[k], "--socket") == 0 && k+1 < argc) socket_path = argv[++k];
+    else if(strcmp(argv[k], "--threads") == 0 && k+1 < argc) n_threads = atoi(argv[++k]);
+    else if(strcmp(argv[k], "--dx") == 0 && k+1 < argc) dx = atof(argv[++k]);
+    else if(strcmp(argv[k], "--dtau") == 0 && k+1 < argc) dtau = atof(argv[++k]);
+    else if(strcmp(argv[k], "--cache-mb") == 0 && k+1 < argc) cache_mb = atof(argv[++k]);
+    else if(strcmp(argv[k], "--surfaces") == 0 && k+1 < argc) surfaces_path = argv[++k];
+    else {
+      cerr << "unknown argument " << argv[k] << endl;
+      return 1;
+    }
+  }
+  if(!valid_grid(dx, dtau, FDM_SERVER_MAX_NODES)) {
+    cerr << "--dx and --dtau must be finite and > 0, with 1+5/dx from 4 to " << FDM_SERVER_MAX_NODES << " nodes" << endl;
+    return 1;
+  }
+
+  server_state server(n_threads, dx, dtau);
+  unique_ptr<FDM_surface_cache> cache;
+  FDM_surface_file surfaces;
+
+  if(surfaces_path != 0) {
+    if(!surfaces.open(surfaces_path)) {
+      cerr << "cannot map surface file " << surfaces_path << endl;
+      return 1;
+    }
+    server.surfaces = &surfaces;
+  }
+
+  // warm up: the workspace and the implicit and CN factorizations of every worker, before the first request
+  server.pricer.warm_up(dx, dtau);
+  if(cache_mb > 0.0) {
+    cache.reset(new FDM_surface_cache((size_t)(cache_mb*1048576.0)));
+    server.cache = cache.get();
+    server.pricer.set_cache(server.cache);
+  }
+  server.pricer.set_surfaces(server.surfaces);
+
+  if(socket_path != 0) {
+#ifdef FDM_UNIX_SOCKETS
+    return serve_socket(&server, socket_path);
+#else
+    cerr << "--socket needs Unix-domain sockets; serve on stdin instead" << endl;
+    return 1;
+#endif
+  }
+
+  while(getline(cin, line)) {
+    if(line.empty()) continue;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    request_record record;
+    if(!handle_request(&server, line, &reply, &record)) break;
+    cout << reply << endl;
+    record_request(&server, record, start);
+  }
+  return 0;
+}
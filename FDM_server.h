@@ -0,0 +1,29 @@
+#ifndef FDM_SERVER_H
+#define FDM_SERVER_H
+
+/**
+ * Long-running pricing server, ./FDM --serve. The thread pool, the workspaces and the implicit / CN
+ * factorizations of the batch pricer stay warm between requests. One request per line, one reply
+ * line per request in the order received:
+ *   price <contract>[;<contract>...]    ok <price>[;<price>...]
+ *   greeks <contract>[;<contract>...]   ok <price>,<delta>,<gamma>,<theta>,<vega>,<rho>[;...]
+ *   stats [reset]                       counters, latency percentiles and, with --cache-mb, the hits
+ *                                       and misses of the surface cache (with --surfaces, the layers
+ *                                       of the mapped file) as one line of JSON
+ *   quit                                ends the session
+ * A contract is a line of a batch file, S,K,r,q,sigma,T,call|put,european|american,method.
+ * A request that cannot be parsed is answered with "error <reason>": every number must be finite,
+ * S, K, sigma and T > 0, and no contract may need more than FDM_SERVER_MAX_NODES grid nodes
+ * (M*N on the grid of the server). A request whose pricing fails is answered the same way, and
+ * so is a request line on a socket that grows beyond FDM_SERVER_MAX_LINE bytes, which is dropped.
+ * Latency is measured from the request line being read to its reply being written, including
+ * the wait for the pricer behind other connections; the percentiles cover the last
+ * FDM_LATENCY_WINDOW price and greeks requests.
+ */
+#define FDM_LATENCY_WINDOW 65536
+#define FDM_SERVER_MAX_NODES 50000000L
+#define FDM_SERVER_MAX_LINE 1048576      // bytes of a request line on a socket
+
+int server_main(int argc, char **argv);
+
+#endif
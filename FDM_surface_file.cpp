@@ -0,0 +1,211 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: binary surface files: final layers written after a run, mapped read-only and priced from in place.
+*
+* */
+
+#include "FDM_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FDM_MMAP
+#endif
+
+using namespace std;
+
+static const char surface_magic[8] = "FDMSURF";
+
+// order of the index: method, type, style, grid, then the model parameters
+static bool key_before(const FDM_surface_file_entry &e, const FDM_surface_key &k) {
+  if(e.method != (int32_t)k.method) return e.method < (int32_t)k.method;
+  if(e.call_or_put != k.call_or_put) return e.call_or_put < k.call_or_put;
+  if(e.amer_or_eur != k.amer_or_eur) return e.amer_or_eur < k.amer_or_eur;
+  if(e.dx != k.dx) return e.dx < k.dx;
+  if(e.dtau != k.dtau) return e.dtau < k.dtau;
+  if(e.r != k.r) return e.r < k.r;
+  if(e.q != k.q) return e.q < k.q;
+  if(e.sigma != k.sigma) return e.sigma < k.sigma;
+  return e.expiry < k.expiry;
+}
+
+static FDM_surface_key entry_key(const FDM_surface_file_entry &e) {
+  FDM_surface_key k = {e.r, e.q, e.sigma, e.expiry, e.dx, e.dtau, e.call_or_put, e.amer_or_eur, (FDM_method)e.method};
+  return k;
+}
+
+static uint64_t align_up(uint64_t offset) {
+  return (offset + FDM_SURFACE_FILE_ALIGN - 1)/FDM_SURFACE_FILE_ALIGN*FDM_SURFACE_FILE_ALIGN;
+}
+
+/**
+ * Writes layers as a surface file (see FDM_surface_file_header); to a temporary name first, then
+ * renamed over path, so a service never maps a half written file
+ * Inputs: const char *path
+ *         surfaces (key and layer of each surface, e.g. FDM_surface_cache::contents())
+ * Output: bool (false when the file cannot be written)
+ */
+bool write_surface_file(const char *path, const vector<pair<FDM_surface_key, shared_ptr<const FDM_surface> > > &surfaces) {
+  vector<pair<FDM_surface_file_entry, const FDM_surface *> > entries;
+  FDM_surface_file_header header;
+  static const char zeros[FDM_SURFACE_FILE_ALIGN] = {};
+  uint64_t offset;
+  size_t k;
+
+  for(k=0; k<surfaces.size(); k++) {
+    const FDM_surface_key &key = surfaces[k].first;
+    const FDM_surface *s = surfaces[k].second.get();
+    FDM_surface_file_entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.r = key.r; e.q = key.q; e.sigma = key.sigma; e.expiry = key.expiry; e.dx = key.dx; e.dtau = key.dtau;
+    e.call_or_put = key.call_or_put; e.amer_or_eur = key.amer_or_eur; e.method = key.method;
+    e.M = s->M;
+    e.alpha = s->alpha;
+    e.beta_tau = s->beta_tau;
+    entries.push_back(make_pair(e, s));
+  }
+  // sorted by key, as the readers binary search the index
+  sort(entries.begin(), entries.end(), [](const pair<FDM_surface_file_entry, const FDM_surface *> &a, const pair<FDM_surface_file_entry, const FDM_surface *> &b) {
+    return key_before(a.first, entry_key(b.first));
+  });
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, surface_magic, sizeof(header.magic));
+  header.version = FDM_SURFACE_FILE_VERSION;
+  header.byte_order = 0x01020304;
+  header.n_entries = entries.size();
+  header.index_offset = sizeof(header);
+  offset = align_up(header.index_offset + entries.size()*sizeof(FDM_surface_file_entry));
+  for(k=0; k<entries.size(); k++) {
+    entries[k].first.x_offset = offset;
+    offset = align_up(offset + entries[k].first.M*sizeof(double));
+    entries[k].first.y_offset = offset;
+    offset = align_up(offset + entries[k].first.M*sizeof(double));
+  }
+  header.file_size = offset;
+
+  string tmp = string(path) + ".tmp";
+  ofstream out(tmp.c_str(), ios::binary | ios::trunc);
+  uint64_t written;
+
+  out.write((const char *)&header, sizeof(header));
+  for(k=0; k<entries.size(); k++) {
+    out.write((const char *)&entries[k].first, sizeof(FDM_surface_file_entry));
+  }
+  written = sizeof(header) + entries.size()*sizeof(FDM_surface_file_entry);
+  for(k=0; k<entries.size(); k++) {
+    const FDM_surface_file_entry &e = entries[k].first;
+    const FDM_surface *s = entries[k].second;
+
+    out.write(zeros, e.x_offset - written);
+    out.write((const char *)s->x.data(), e.M*sizeof(double));
+    out.write(zeros, e.y_offset - (e.x_offset + e.M*sizeof(double)));
+    out.write((const char *)s->y.data(), e.M*sizeof(double));
+    written = e.y_offset + e.M*sizeof(double);
+  }
+  out.write(zeros, header.file_size - written);
+  out.close();
+  if(!out || rename(tmp.c_str(), path) != 0) {
+    remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Maps a surface file and checks its header, index and data offsets against its size
+ * Inputs: const char *path
+ * Output: bool (false if the file is missing, truncated, of another version or byte order)
+ */
+bool FDM_surface_file::open(const char *path) {
+  close();
+
+#ifdef FDM_MMAP
+  struct stat st;
+  int fd = ::open(path, O_RDONLY);
+
+  if(fd < 0) return false;
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FDM_surface_file_header)) {
+    ::close(fd);
+    return false;
+  }
+  void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // the mapping stays valid
+  if(p == MAP_FAILED) return false;
+  data = (const char *)p;
+  bytes = st.st_size;
+  mapped = 1;
+#else
+  ifstream in(path, ios::binary);
+  if(!in) return false;
+  buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  data = buffer.data();
+  bytes = buffer.size();
+#endif
+
+  // every bound is compared by subtraction from bytes, so offsets near 2^64 cannot wrap past it
+  const FDM_surface_file_header *h = (const FDM_surface_file_header *)data;
+  bool valid = bytes >= sizeof(FDM_surface_file_header) && memcmp(h->magic, surface_magic, sizeof(h->magic)) == 0 &&
+               h->version == FDM_SURFACE_FILE_VERSION && h->byte_order == 0x01020304 && h->file_size == bytes &&
+               h->index_offset % 8 == 0 && h->index_offset <= bytes &&
+               h->n_entries <= (bytes - h->index_offset)/sizeof(FDM_surface_file_entry);
+  if(valid) {
+    const FDM_surface_file_entry *e = (const FDM_surface_file_entry *)(data + h->index_offset);
+    for(uint64_t k=0; k<h->n_entries && valid; k++) {
+      uint64_t layer = (uint64_t)e[k].M*sizeof(double);
+      valid = e[k].M >= 4 && layer <= bytes && e[k].x_offset % FDM_SURFACE_FILE_ALIGN == 0 && e[k].y_offset % FDM_SURFACE_FILE_ALIGN == 0 &&
+              e[k].x_offset <= bytes - layer && e[k].y_offset <= bytes - layer;
+    }
+  }
+  if(!valid) {
+    close();
+    return false;
+  }
+  header = h;
+  entries = (const FDM_surface_file_entry *)(data + h->index_offset);
+  return true;
+}
+
+void FDM_surface_file::close() {
+#ifdef FDM_MMAP
+  if(mapped) munmap((void *)data, bytes);
+#endif
+  buffer.clear();
+  data = 0;
+  bytes = 0;
+  mapped = 0;
+  header = 0;
+  entries = 0;
+}
+
+// entry of key in the mapped index, 0 if there is none
+const FDM_surface_file_entry *FDM_surface_file::find(const FDM_surface_key &key) const {
+  if(header == 0) return 0;
+
+  const FDM_surface_file_entry *end = entries + header->n_entries;
+  const FDM_surface_file_entry *e = lower_bound(entries, end, key, key_before);
+  return (e != end && entry_key(*e) == key) ? e : 0;
+}
+
+/**
+ * Price of contract c interpolated on its mapped layer, as FDM_surface_cache::price
+ * Inputs: FDM_contract c, double dx, dtau (grid the layer was solved on)
+ * Output: double *value (value of option, when found)
+ *         bool (false when the file has no layer for c)
+ */
+bool FDM_surface_file::price(const FDM_contract &c, double dx, double dtau, double *value) const {
+  FDM_surface_key key = {c.r, c.q, c.sigma, c.expiry, dx, dtau, c.call_or_put, c.amer_or_eur, c.method};
+  const FDM_surface_file_entry *e = find(key);
+
+  if(e == 0) return false;
+  *value = value_at_spot(c.S, c.K, e->alpha, e->beta_tau, e->M, (const double *)(data + e->x_offset), (const double *)(data + e->y_offset));
+  return true;
+}
@@ -0,0 +1,465 @@
+/**
+* ==================================================================================================================================
+* Name: 		David Turner
+* Description: One theta scheme march behind every engine: explicit, implicit and Crank-Nicholson steps with Rannacher
+*              start-up, and the linear solve of each step supplied by a solver policy.
+*
+* */
+
+#include <cmath>
+#include <algorithm>
+#include "FDM_utils.h"
+#include "FDM_engines.h"
+#include "FDM_profile.h"
+
+using namespace std;
+
+// what a solver policy is set up with: the step matrix is heat_operator_matrix(M, lw, uw, theta)
+struct step_setup {
+  int M;
+  const double *lw, *uw;
+  double theta, w, dtau;
+  int call_or_put;
+  int sor_sweeps;
+  const FDM_options *opts;
+};
+
+/**
+ * Solver policies of theta_march. Each one solves the step matrix for x, given the right hand
+ * side b, and exposes the workspace and factorization it uses so the bumps of bump_greeks can
+ * share them:
+ *   projects   the policy applies the early exercise constraint itself (obstacle is null for
+ *              Europeans); otherwise the march clamps the unconstrained solution afterwards
+ *   in_place   the matrix is the identity, the march builds the right hand side in x itself
+ * On entry x holds the layer before y_old (layer j-2), which psor_step extrapolates from.
+ */
+struct explicit_step {
+  static const bool projects = true;
+  static const bool in_place = true;
+  int M = 0;
+
+  void setup(const step_setup &s) { M = s.M; }
+  void solve(int, const double *, const double *obstacle, const double *, double *x) {
+    int i;
+
+    // the boundary rows hold the boundary values and are not projected
+    if(obstacle != 0) {
+      for(i=1; i<M-1; i++) {
+        x[i] = fmax(x[i],obstacle[i]); // check for early exercise
+      }
+    }
+  }
+  FDM_workspace *workspace() { return 0; }
+  const FDM_tridiag_factor *factor() { return 0; }
+};
+
+// matrix of the step and the scratch space of the solvers that eliminate it every step
+struct matrix_step {
+  int M = 0;
+  double *a = 0;
+  FDM_workspace local_ws, *ws = 0;
+
+  void setup(const step_setup &s) {
+    M = s.M;
+    a = new double[3*M]; // tridiagonal matrix
+                         // main diagonal stored at a[3*i+1]
+                         // sub diagonal stored at a[3*i]
+                         // sup diagonal stored at a[3*i+2]
+    heat_operator_matrix(M, s.lw, s.uw, s.theta, a);
+    // the solver writes using the workspace, nothing is allocated inside the time loop
+    ws = (s.opts != 0 && s.opts->workspace != 0) ? s.opts->workspace : &local_ws;
+    workspace_reserve(ws, M);
+  }
+  ~matrix_step() {
+    delete [] a;
+    workspace_free(&local_ws);
+  }
+  FDM_workspace *workspace() { return ws; }
+  const FDM_tridiag_factor *factor() { return 0; }
+};
+
+struct thomas_step : matrix_step {
+  static const bool projects = false;
+  static const bool in_place = false;
+
+  void solve(int, const double *b, const double *, const double *, double *x) {
+    thomas_method(M, a, b, x, ws); // solves x = a \ b
+  }
+};
+
+struct factored_step {
+  static const bool projects = false;
+  static const bool in_place = false;
+  FDM_tridiag_factor local_op;
+  FDM_partition_factor part;
+  const FDM_tridiag_factor *op = 0;
+  FDM_workspace local_ws, *ws = 0;
+
+  // factorized once for the whole march; a factorization shared by the caller is used when it matches the grid,
+  // otherwise a very fine grid is partitioned so the blocks of each solve run side by side, on the team of
+  // the workspace, which the bumped runs share
+  void setup(const step_setup &s) {
+    ws = (s.opts != 0 && s.opts->workspace != 0) ? s.opts->workspace : &local_ws;
+    op = shared_heat_operator(s.opts, s.M, s.w, s.dtau, s.theta);
+    if(op == 0 && s.M >= FDM_PARTITION_MIN_N) {
+      double *a = new double[3*s.M];
+
+      heat_operator_matrix(s.M, s.lw, s.uw, s.theta, a);
+      partition_factor(s.M, a, partition_threads((s.opts != 0) ? s.opts->solver_threads : 0), &part, ws);
+      delete [] a;
+    } else if(op == 0) {
+      op = heat_operator(s.opts, s.M, s.w, s.dtau, s.theta, &local_op);
+    }
+  }
+  ~factored_step() {
+    tridiag_factor_free(&local_op);
+    partition_factor_free(&part);
+    workspace_free(&local_ws);
+  }
+  void solve(int, const double *b, const double *, const double *, double *x) {
+    if(op != 0) tridiag_solve(op, b, x); // solves x = a \ b
+    else partition_solve(&part, b, x);
+  }
+  FDM_workspace *workspace() { return ws; }
+  const FDM_tridiag_factor *factor() { return op; }
+};
+
+// fixed sweeps from zero, the boundary entries are left at zero
+struct sor_step : matrix_step {
+  static const bool projects = false;
+  static const bool in_place = false;
+  int sweeps = 0;
+
+  void setup(const step_setup &s) {
+    matrix_step::setup(s);
+    sweeps = s.sor_sweeps;
+  }
+  void solve(int, const double *b, const double *, const double *, double *x) {
+    sor_method(M, a, b, x, 1.2, sweeps, ws); // relaxation factor set to 1.2
+  }
+};
+
+// sweeps to tolerance, projected inside the sweep for Americans, from the previous layer extrapolated in time
+struct psor_step : matrix_step {
+  static const bool projects = true;
+  static const bool in_place = false;
+  FDM_sor_control local_ctl, *ctl = 0;
+
+  void setup(const step_setup &s) {
+    matrix_step::setup(s);
+    ctl = (s.opts != 0 && s.opts->sor != 0) ? s.opts->sor : &local_ctl;
+  }
+  void solve(int j, const double *b, const double *obstacle, const double *y_old, double *x) {
+    int i;
+
+    for(i=0; i<M; i++) {
+      x[i] = (j > 1) ? 2.0*y_old[i] - x[i] : y_old[i];
+    }
+    psor_method(M, a, b, obstacle, x, ctl);
+  }
+};
+
+// direct solve with the early exercise constraint applied during the substitution
+struct brennan_schwartz_step : matrix_step {
+  static const bool projects = true;
+  static const bool in_place = false;
+  int call_or_put = 1;
+
+  void setup(const step_setup &s) {
+    matrix_step::setup(s);
+    call_or_put = s.call_or_put;
+  }
+  void solve(int, const double *b, const double *obstacle, const double *, double *x) {
+    if(obstacle != 0) brennan_schwartz(M, a, b, obstacle, call_or_put, x, ws);
+    else thomas_method(M, a, b, x, ws);
+  }
+};
+
+/**
+ * The theta scheme march, compiled per solver policy, option type and exercise style
+ *   Step j solves (1 + theta*L) y_j = (1 - (1-theta)*L) y_{j-1} with L the second difference
+ *   scaled by dtau (weights lw, uw). The boundary rows carry theta*lw*bc (lw*bc when theta = 0)
+ *   and the early exercise value is the payoff at the time of each layer, in the units of y.
+ *   With opts->rannacher_steps = R and 0 < theta < 1 the first R steps are each replaced by two
+ *   implicit half steps, which damps the oscillations Crank-Nicholson keeps from the payoff kink.
+ */
+template<class Solver, int call_or_put, bool american>
+static double theta_march(const FDM_theta_scheme &scheme, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, const FDM_options *opts) {
+  Solver solver, start;
+  step_setup setup;
+  double *b;
+  double *fvec;
+
+  double w, theta = scheme.theta;
+  double *lw, *uw, *lw_half = 0, *uw_half = 0;
+  double *y_old, *y_new, *y_mid = 0, *y_tmp;
+  double *obstacle;
+  double lo_bc, hi_bc, lo_growth, hi_growth, lo_half_growth = 1.0, hi_half_growth = 1.0;
+  double *payoff = 0, ex = 1.0, ex_growth = 1.0, ex_half_growth = 1.0;
+  int i, j, rannacher = 0;
+  double *t, *x;
+  double t_max, t_min, x_max, x_min;
+  int N, M;
+
+  double rp = 2*r/(sigma*sigma);
+  double qp = 2*(r-q)/(sigma*sigma);
+  double alpha = -0.5*(qp-1);
+  double beta = -0.25*(qp-1)*(qp-1) - rp;
+
+  FDM_PROFILE_CALL();
+  FDM_PROFILE_PHASE(PHASE_GRID_SETUP);
+
+  // x = log(S/K) ranges from -2.5 to 2.5
+  // proxy for 0 to "infinity"
+  x_min = -2.5;
+  x_max = 2.5;
+  M = 1 + ((x_max - x_min)/dx);
+  if(opts != 0 && opts->grid != 0) M = opts->n_grid; // non-uniform grid, dx is not used
+
+  x = new double[M];
+
+  // setup x vector with M elements at steps of dx
+  for(i=0; i<M; i++) {
+    x[i] = (opts != 0 && opts->grid != 0) ? opts->grid[i] : x_min + i*dx;
+  }
+
+  // tau vector ranges from 0 to 0.5*sigma^2*expiry
+  t_min = 0.0;
+  t_max = 0.5*(sigma*sigma)*expiry;
+  N = 1 + ((t_max - t_min)/dtau);
+
+  t = new double[N];
+
+  // setup t vector with N elements at steps of dtau
+  for(j=0; j<N; j++) {
+    t[j] = t_min + j*dtau;
+  }
+
+  // only two time layers are kept: y_old holds layer j-1, y_new receives layer j
+  y_old = new double[M];
+  y_new = new double[M];
+
+  FDM_PROFILE_PHASE(PHASE_PAYOFF);
+
+  // payoff in the transformed variables, evaluated once per node
+  obstacle = new double[M];
+
+  for(i=0; i<M; i++) {
+    obstacle[i] = call_or_put*(exp(0.5*x[i]*(qp+1))-exp(0.5*x[i]*(qp-1)));
+    // Initial condition (at tau=0)
+    y_old[i] = fmax(obstacle[i],0.0);
+  }
+  store_snapshot(opts, 0, M, y_old);
+  store_expiry_values(opts, N==1, S, K, sigma, alpha, beta, t[0], t[0], M, x, y_old, y_old);
+
+  w = dtau/(dx*dx); // for explicit FDM, w <= 0.5 for stability
+
+  // weights of y[i-1] and y[i+1] in the step at node i, all equal to w on the uniform grid
+  lw = new double[M];
+  uw = new double[M];
+  if(opts != 0 && opts->grid != 0) {
+    grid_weights(M, x, dtau, lw, uw);
+  } else {
+    for(i=0; i<M; i++) {
+      lw[i] = uw[i] = w;
+    }
+  }
+
+  // early exercise value: the payoff, ex*payoff with ex = exp(-beta*tau) in y units, ex grown
+  // step by step as the boundary values are
+  if(american) {
+    payoff = new double[M];
+    copy(obstacle, obstacle + M, payoff);
+    ex_growth = exp(-beta*dtau);
+    ex_half_growth = exp(-beta*0.5*dtau);
+  }
+
+  FDM_PROFILE_PHASE(PHASE_GRID_SETUP);
+
+  // the boundary values exp(0.5*(qp-1)*x[0]+0.25*(qp-1)^2*t[j]) and its qp+1 counterpart
+  // at x[M-1] grow geometrically in j, so each step costs one multiplication instead of an exp
+  lo_bc = exp(0.5*(qp-1)*x[0]);
+  hi_bc = exp(0.5*(qp+1)*x[M-1]);
+  lo_growth = exp(0.25*(qp-1)*(qp-1)*dtau);
+  hi_growth = exp(0.25*(qp+1)*(qp+1)*dtau);
+
+  setup.M = M;
+  setup.lw = lw;
+  setup.uw = uw;
+  setup.theta = theta;
+  setup.w = w;
+  setup.dtau = dtau;
+  setup.call_or_put = call_or_put;
+  setup.sor_sweeps = scheme.sor_sweeps;
+  setup.opts = opts;
+  solver.setup(setup);
+
+  // Rannacher start-up: implicit half steps, whose weights are half those of the full step
+  if(opts != 0 && opts->rannacher_steps > 0 && theta > 0.0 && theta < 1.0 && !Solver::in_place) {
+    rannacher = min(opts->rannacher_steps, N-1);
+    lw_half = new double[M];
+    uw_half = new double[M];
+    for(i=0; i<M; i++) {
+      lw_half[i] = 0.5*lw[i];
+      uw_half[i] = 0.5*uw[i];
+    }
+    setup.lw = lw_half;
+    setup.uw = uw_half;
+    setup.theta = 1.0;
+    setup.w = 0.5*w;
+    setup.dtau = 0.5*dtau;
+    start.setup(setup);
+    y_mid = new double[M];
+    lo_half_growth = exp(0.25*(qp-1)*(qp-1)*0.5*dtau);
+    hi_half_growth = exp(0.25*(qp+1)*(qp+1)*0.5*dtau);
+  }
+
+  b = Solver::in_place ? 0 : new double[M];
+  fvec = (american && !Solver::projects) ? new double[M] : 0; // unprojected solution, Americans only
+
+  // one step of weight th from y_from to y_to, with the boundary values lo, hi at its end
+  auto step = [&](Solver &s, int js, double th, const double *lw_s, const double *uw_s, double lo, double hi, const double *y_from, double *y_to) {
+    double bw = (th > 0.0) ? th : 1.0;
+    double *rhs = Solver::in_place ? y_to : b;
+
+    FDM_PROFILE_PHASE(PHASE_RHS);
+    // Boundary condition at x=-2.5
+    rhs[0] = (call_or_put>0)?0.0:bw*lw_s[0]*lo;
+
+    if(th < 1.0) {
+      for(i=1; i<M-1; i++) {
+        // explicit part of the step
+        rhs[i] = y_from[i]+(1.0-th)*(lw_s[i]*y_from[i-1]-(lw_s[i]+uw_s[i])*y_from[i]+uw_s[i]*y_from[i+1]);
+      }
+    } else {
+      for(i=1; i<M-1; i++) {
+        rhs[i] = y_from[i]; // copy current column to b
+      }
+    }
+    // Boundary condition at x=2.5
+    rhs[M-1] = (call_or_put>0)?bw*uw_s[M-1]*hi:0.0;
+
+    FDM_PROFILE_PHASE(PHASE_SOLVE);
+    if(american && !Solver::projects) {
+      s.solve(js, rhs, 0, y_from, fvec); // solves fvec = a \ b, to get interior points
+
+      FDM_PROFILE_PHASE(PHASE_PROJECT);
+      for(i=0; i<M; i++) {
+        y_to[i] = fmax(fvec[i],obstacle[i]); // check for early exercise
+      }
+    } else {
+      s.solve(js, rhs, american ? obstacle : 0, y_from, y_to); // the solution is the new layer
+    }
+  };
+
+  // early exercise value at the end of the next step, ex growing from the value at its start
+  auto scale_obstacle = [&](double ex_end) {
+    if(payoff != 0) {
+      for(i=0; i<M; i++) {
+        obstacle[i] = ex_end*payoff[i];
+      }
+    }
+  };
+
+  for(j=1; j<N; j++) {
+    if(j <= rannacher) {
+      scale_obstacle(ex*ex_half_growth);
+      step(start, 1, 1.0, lw_half, uw_half, lo_bc*lo_half_growth, hi_bc*hi_half_growth, y_old, y_mid);
+      scale_obstacle(ex*ex_growth);
+      step(start, 1, 1.0, lw_half, uw_half, lo_bc*lo_growth, hi_bc*hi_growth, y_mid, y_new);
+    } else {
+      scale_obstacle(ex*ex_growth);
+      step(solver, j, theta, lw, uw, lo_bc*lo_growth, hi_bc*hi_growth, y_old, y_new);
+    }
+    lo_bc *= lo_growth; // boundary values at t[j]
+    hi_bc *= hi_growth;
+    ex *= ex_growth;
+
+    FDM_PROFILE_PHASE(PHASE_INTERPOLATE);
+    store_snapshot(opts, j, M, y_new);
+    store_expiry_values(opts, j==N-1, S, K, sigma, alpha, beta, t[j-1], t[j], M, x, y_old, y_new);
+    y_tmp = y_old; // layer j becomes the previous layer of the next step
+    y_old = y_new;
+    y_new = y_tmp;
+  }
+
+  FDM_PROFILE_PHASE(PHASE_INTERPOLATE);
+  j = N-1; // value at tau (t=0)
+
+  // value of the option at x = log(S/K), interpolated on the final layer,
+  // and at every spot and strike of the ladders requested in opts
+  double value = value_at_spot(S, K, alpha, beta*t[j], M, x, y_old);
+  store_spot_values(opts, K, alpha, beta*t[j], M, x, y_old);
+  store_strike_values(opts, S, alpha, beta*t[j], M, x, y_old);
+
+  // greeks from the final and penultimate (y_new after the last swap) layers, and by bumps if asked
+  store_greeks(opts, S, K, sigma, alpha, beta, t[j], t[(j>0)?j-1:j], M, x, y_old, (j>0)?y_new:y_old);
+  FDM_PROFILE_PHASE_END();
+  if(scheme.engine != 0) {
+    store_bumped_greeks(opts, scheme.engine, solver.workspace(), solver.factor(), S, K, r, q, sigma, expiry, dx, dtau, call_or_put, american ? 1 : 0);
+  }
+
+  delete [] b;
+  delete [] fvec;
+  delete [] y_mid;
+  delete [] obstacle;
+  delete [] payoff;
+  delete [] lw;
+  delete [] uw;
+  delete [] lw_half;
+  delete [] uw_half;
+  delete [] y_old;
+  delete [] y_new;
+  delete [] t;
+  delete [] x;
+
+  return value;
+}
+
+// instance of the march for the option type and exercise style of the call
+template<class Solver>
+static double theta_dispatch(const FDM_theta_scheme &scheme, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts) {
+  if(call_or_put > 0) {
+    return (amer_or_eur == 1) ? theta_march<Solver, 1, true>(scheme, S, K, r, q, sigma, expiry, dx, dtau, opts)
+                              : theta_march<Solver, 1, false>(scheme, S, K, r, q, sigma, expiry, dx, dtau, opts);
+  }
+  return (amer_or_eur == 1) ? theta_march<Solver, -1, true>(scheme, S, K, r, q, sigma, expiry, dx, dtau, opts)
+                            : theta_march<Solver, -1, false>(scheme, S, K, r, q, sigma, expiry, dx, dtau, opts);
+}
+
+/**
+ * Solves Black Scholes equation with a theta scheme finite difference method
+ *   Every engine is a theta_fdm call: ExplicitFDM (theta=0), ImplicitFDM and ImplicitSORFDM
+ *   (theta=1), CN_FDM and CN_SORFDM (theta=0.5), differing in the solver of the step.
+ *   STEP_SOR picks the solver as the SOR engines always did: Brennan-Schwartz for Americans when
+ *   opts->american_solver asks for it, else psor_method when opts->sor is set, else fixed sweeps.
+ *   The fixed sweeps are far from converged on a non-uniform grid, whose weights near the strike
+ *   are large, so with opts->grid psor_method runs to tolerance even without opts->sor.
+ * Inputs: FDM_theta_scheme scheme (theta, solver of the step, and the engine to reprice bumps with)
+ *         double S, K, r, q, sigma, expiry, dx, dtau, int call_or_put, amer_or_eur (as for the engines)
+ *         const FDM_options *opts (optional, as for the engines, with rannacher_steps for 0 < theta < 1)
+ * Output: double value (value of option)
+ */
+double theta_fdm(const FDM_theta_scheme &scheme, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, const FDM_options *opts) {
+  switch(scheme.solver) {
+  case STEP_EXPLICIT:
+    return theta_dispatch<explicit_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  case STEP_THOMAS:
+    return theta_dispatch<thomas_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  case STEP_FACTORED:
+    return theta_dispatch<factored_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  case STEP_SOR:
+    if(amer_or_eur == 1 && opts != 0 && opts->american_solver == AMERICAN_BRENNAN_SCHWARTZ) {
+      return theta_dispatch<brennan_schwartz_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+    }
+    if(opts != 0 && (opts->sor != 0 || opts->grid != 0)) {
+      return theta_dispatch<psor_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+    }
+    return theta_dispatch<sor_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  case STEP_PSOR:
+    return theta_dispatch<psor_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  case STEP_BRENNAN_SCHWARTZ:
+    return theta_dispatch<brennan_schwartz_step>(scheme, S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, opts);
+  }
+  return 0.0;
+}
@@ -1,15 +1,51 @@
 /**
 * ==================================================================================================================================
 * Name: 		David Turner
-* Description: a utility class encapsulating thomas method & sor method.
+* Description: a utility class encapsulating thomas method & sor method, their reusable workspace, cubic interpolation,
+*              and the layer snapshots, spot, strike and expiry ladders and greeks of the engines.
 *
 * */
 
 #include "FDM_utils.h"
+#include "FDM_engines.h"
+#include "FDM_profile.h"
 #include <cmath>
+#include <algorithm>
 
 using namespace std;
 
+/**
+ * Makes sure every buffer of the workspace holds at least n doubles
+ * Inputs : FDM_workspace* ws (grown in place, existing buffers are reused when large enough)
+ *          int n (number of steps)
+ */
+void workspace_reserve(FDM_workspace *ws, int n) {
+  if(ws->n >= n) return;
+
+  delete [] ws->diag_new;
+  delete [] ws->b_new;
+  delete [] ws->x_new;
+  ws->diag_new = new double[n];
+  ws->b_new = new double[n];
+  ws->x_new = new double[n];
+  ws->n = n;
+}
+
+/**
+ * Releases the buffers and the team of the workspace, which can be reserved again afterwards
+ */
+void workspace_free(FDM_workspace *ws) {
+  partition_team_free(ws->team);
+  ws->team = 0;
+  delete [] ws->diag_new;
+  delete [] ws->b_new;
+  delete [] ws->x_new;
+  ws->diag_new = 0;
+  ws->b_new = 0;
+  ws->x_new = 0;
+  ws->n = 0;
+}
+
 /**
  * Function to implement Thomas algorithm for tridiagonal matrix
  * Inputs : int n (number of steps)
@@ -19,12 +55,28 @@ using namespace std;
  *          Thus, x = a \ b
  */
 double* thomas_method(int n, double *a, double *b) {
-  int i;
-  double *x, *diag_new, *b_new;
+  double *x = new double[n];
+  FDM_workspace ws;
 
-  x = new double[n];
-  diag_new = new double[n];
-  b_new = new double[n];
+  workspace_reserve(&ws, n);
+  thomas_method(n, a, b, x, &ws);
+  workspace_free(&ws);
+  return x;
+}
+
+/**
+ * Function to implement Thomas algorithm for tridiagonal matrix, without allocating
+ * Inputs : int n (number of steps)
+ *          double* a (length=3*n), stores tridiagonal matrix
+ *          double* b (length=n), stores right hand side
+ *          FDM_workspace* ws (capacity >= n), scratch space
+ * Output : double* x (length=n, written in place), where a*x = b
+ *          Thus, x = a \ b
+ */
+void thomas_method(int n, const double *a, const double *b, double *x, FDM_workspace *ws) {
+  int i;
+  double *diag_new = ws->diag_new;
+  double *b_new = ws->b_new;
 
   // main diagonal is stored in a[3*i+1]
   // sub diagonal is stored in a[3*i]
@@ -42,9 +94,162 @@ double* thomas_method(int n, double *a, double *b) {
   for(i=n-2; i>=0; i--) {
     x[i] = (b_new[i] - a[3*i+2]*x[i+1])/diag_new[i];
   }
-  delete [] diag_new;
-  delete [] b_new;
-  return x;
+}
+
+/**
+ * Factorizes a tridiagonal matrix once for repeated solves with tridiag_solve
+ * Inputs : int n (number of steps)
+ *          double* a (length=3*n), stores tridiagonal matrix
+ * Output : FDM_tridiag_factor* f, multipliers and reciprocal pivots of the Thomas elimination
+ */
+void tridiag_factor(int n, const double *a, FDM_tridiag_factor *f) {
+  int i;
+  double pivot;
+
+  tridiag_factor_free(f);
+  f->n = n;
+  f->lower = new double[n];
+  f->upper = new double[n];
+  f->inv_pivot = new double[n];
+
+  // main diagonal is stored in a[3*i+1]
+  // sub diagonal is stored in a[3*i]
+  // sup diagonal is stored in a[3*i+2]
+  pivot = a[3*0+1];
+  f->lower[0] = 0.0;
+  f->upper[0] = a[3*0+2];
+  f->inv_pivot[0] = 1.0/pivot;
+  for(i=1; i<n; i++) {
+    f->lower[i] = a[3*i]/pivot;
+    pivot = a[3*i+1] - a[3*(i-1)+2]*f->lower[i];
+    f->upper[i] = a[3*i+2];
+    f->inv_pivot[i] = 1.0/pivot;
+  }
+  // the last unknown is divided by the unmodified diagonal, exactly as in thomas_method
+  f->inv_pivot[n-1] = 1.0/a[3*(n-1)+1];
+}
+
+/**
+ * Builds the matrix of the implicit (theta=1) or Crank-Nicholson (theta=0.5) step
+ *   interior row i: -theta*lw[i]*y[i-1] + (1+theta*(lw[i]+uw[i]))*y[i] - theta*uw[i]*y[i+1],
+ *   with the boundary rows and their couplings laid out as the engines always had them
+ * Inputs : int n (number of points in space)
+ *          double* lw, uw (length=n), dtau times the weights of y[i-1] and y[i+1] in y_xx at
+ *                  node i; both are w = dtau/dx^2 on a uniform grid (see grid_weights)
+ *          double theta (weight of the implicit part of the scheme)
+ * Output : double* a (length=3*n), stores tridiagonal matrix
+ */
+void heat_operator_matrix(int n, const double *lw, const double *uw, double theta, double *a) {
+  int i;
+
+  // main diagonal is stored in a[3*i+1]
+  // sub diagonal is stored in a[3*i]
+  // sup diagonal is stored in a[3*i+2]
+  a[0+0*3] = 0.0; //unused
+  a[1+0*3] = 1.0;
+  a[2+0*3] = -theta*uw[0];
+
+  for(i=1; i<n-1; i++) {
+    a[0+i*3] = (i > 1) ? -theta*lw[i] : 0.0;
+    a[1+i*3] = 1.0 + theta*(lw[i]+uw[i]);
+    a[2+i*3] = (i < n-2) ? -theta*uw[i] : 0.0;
+  }
+
+  a[0+(n-1)*3] = -theta*lw[n-1];
+  a[1+(n-1)*3] = 1.0;
+  a[2+(n-1)*3] = 0.0; //unused
+}
+
+/**
+ * Builds and factorizes the matrix of the implicit (theta=1) or Crank-Nicholson (theta=0.5)
+ * step on a uniform grid, so the result can be shared between options
+ * Inputs : int n (number of points in space)
+ *          double w (dtau/dx^2)
+ *          double theta (weight of the implicit part of the scheme)
+ * Output : FDM_tridiag_factor* f, tagged with w and theta
+ */
+void heat_operator_factor(int n, double w, double theta, FDM_tridiag_factor *f) {
+  int i;
+  double *a = new double[3*n];
+  double *lw = new double[n];
+
+  for(i=0; i<n; i++) {
+    lw[i] = w;
+  }
+  heat_operator_matrix(n, lw, lw, theta, a);
+
+  tridiag_factor(n, a, f);
+  f->w = w;
+  f->theta = theta;
+  f->grid = 0;
+  f->dtau = 0.0;
+
+  delete [] a;
+  delete [] lw;
+}
+
+/**
+ * Builds and factorizes the matrix of the implicit (theta=1) or Crank-Nicholson (theta=0.5)
+ * step on a non-uniform grid
+ * Inputs : int n (number of points in space)
+ *          double* grid (length=n), increasing nodes in x
+ *          double dtau (step size in time)
+ *          double theta (weight of the implicit part of the scheme)
+ * Output : FDM_tridiag_factor* f, tagged with grid, dtau and theta
+ */
+void heat_operator_factor(int n, const double *grid, double dtau, double theta, FDM_tridiag_factor *f) {
+  double *a = new double[3*n];
+  double *lw = new double[n];
+  double *uw = new double[n];
+
+  grid_weights(n, grid, dtau, lw, uw);
+  heat_operator_matrix(n, lw, uw, theta, a);
+
+  tridiag_factor(n, a, f);
+  f->w = 0.0;
+  f->theta = theta;
+  f->grid = grid;
+  f->dtau = dtau;
+
+  delete [] a;
+  delete [] lw;
+  delete [] uw;
+}
+
+/**
+ * Releases the storage of a factorization
+ */
+void tridiag_factor_free(FDM_tridiag_factor *f) {
+  delete [] f->lower;
+  delete [] f->upper;
+  delete [] f->inv_pivot;
+  f->lower = 0;
+  f->upper = 0;
+  f->inv_pivot = 0;
+  f->n = 0;
+}
+
+/**
+ * Solves a*x = b with a factorization from tridiag_factor, without divisions or allocation
+ * Inputs : FDM_tridiag_factor* f, factorization of a
+ *          double* b (length=f->n), stores right hand side
+ * Output : double* x (length=f->n, written in place, may alias b), where a*x = b
+ */
+void tridiag_solve(const FDM_tridiag_factor *f, const double *b, double *x) {
+  int i, n = f->n;
+  const double *lower = f->lower, *upper = f->upper, *inv_pivot = f->inv_pivot;
+
+  // forward substitution, x holds the eliminated right hand side
+  x[0] = b[0];
+  for(i=1; i<n; i++) {
+    x[i] = b[i] - lower[i]*x[i-1];
+  }
+
+  // backward substitution
+  x[n-1] = x[n-1]*inv_pivot[n-1];
+  for(i=n-2; i>=0; i--) {
+    x[i] = (x[i] - upper[i]*x[i+1])*inv_pivot[i];
+  }
 }
 
 /**
@@ -58,16 +263,36 @@ double* thomas_method(int n, double *a, double *b) {
  *          Thus, x = a \ b
  */
 double* sor_method(int n, double *a, double *b, double relax, int max_iter) {
+  double *x = new double[n];
+  FDM_workspace ws;
+
+  workspace_reserve(&ws, n);
+  sor_method(n, a, b, x, relax, max_iter, &ws);
+  workspace_free(&ws);
+  return x;
+}
+
+/**
+ * Function to implement Successive OverRelaxation for tridiagonal matrix, without allocating
+ * Inputs : int n (number of steps)
+ *          double* a (length=3*n), stores tridiagonal matrix
+ *          double* b (length=n), stores right hand side
+ *          double relax, the relaxation parameter
+ *          int max_iter, maximum iterations before SOR terminates
+ *          FDM_workspace* ws (capacity >= n), scratch space
+ * Output : double* x (length=n, written in place), where a*x = b
+ *          Thus, x = a \ b
+ */
+void sor_method(int n, const double *a, const double *b, double *x, double relax, int max_iter, FDM_workspace *ws) {
   int iter, i;
-  double *x, *x_new;
+  double *x_new = ws->x_new;
   double square_sum = 0.0, tol = 1e-6;
 
-  x = new double[n];
-  x_new = new double[n];
-
   for(i=0; i<n; i++) {
     x[i] = 0.0; // initialize x vector to 0
   }
+  x_new[0] = 0.0; // boundary entries are not iterated
+  x_new[n-1] = 0.0;
 
   // main diagonal is stored in a[3*i+1]
   // sub diagonal is stored in a[3*i]
@@ -86,13 +311,488 @@ double* sor_method(int n, double *a, double *b, double relax, int max_iter) {
     // if change from x to x_new is below tolerance, or if
     // max iterations is reached, terminate and return best guess
     if (sqrt(square_sum) < tol || iter==max_iter) {
-      delete [] x_new;
-      return x;
+      FDM_PROFILE_SOR(iter, sqrt(square_sum), sqrt(square_sum) < tol);
+      return;
     }
     for(i=1; i<n-1; i++) {
       x[i] = x_new[i]; // set x to x_new and continue iteration
     }
     square_sum = 0.0; // reset error back to 0 before next loop
   }
+}
+
+// one Gauss-Seidel sweep over all rows with relaxation omega, returns the largest change of x
+template<bool projected>
+static double psor_sweep(int n, const double *a, const double *b, const double *obstacle, double *x, double omega) {
+  int i;
+  double x_i, change_max;
+
+  x_i = x[0] + omega*(b[0] - a[1]*x[0] - a[2]*x[1])/a[1];
+  if(projected) x_i = fmax(x_i, obstacle[0]);
+  change_max = fabs(x_i - x[0]);
+  x[0] = x_i;
+
+  for(i=1; i<n-1; i++) {
+    x_i = x[i] + omega*(b[i] - a[3*i]*x[i-1] - a[3*i+1]*x[i] - a[3*i+2]*x[i+1])/a[3*i+1];
+    if(projected) x_i = fmax(x_i, obstacle[i]);
+    change_max = fmax(change_max, fabs(x_i - x[i]));
+    x[i] = x_i;
+  }
+
+  i = n-1;
+  x_i = x[i] + omega*(b[i] - a[3*i]*x[i-1] - a[3*i+1]*x[i])/a[3*i+1];
+  if(projected) x_i = fmax(x_i, obstacle[i]);
+  change_max = fmax(change_max, fabs(x_i - x[i]));
+  x[i] = x_i;
+
+  return change_max;
+}
+
+/**
+ * Projected Successive OverRelaxation for tridiagonal matrix, warm started and run to a tolerance
+ *   Every row is swept, boundary rows included, starting from the guess passed in x (the
+ *   previous time layer is a good one). With an obstacle each update is projected at once,
+ *   x[i] = max(x[i] + omega*r[i]/a_ii, obstacle[i]), which solves the American step.
+ *   The sweeps stop when the largest change of x in a sweep, omega times the residual scaled by
+ *   the diagonal, is below ctl->tol.
+ *   With ctl->adapt_omega the asymptotic ratio lambda of successive changes gives the Jacobi
+ *   spectral radius mu, from (lambda+omega-1)^2 = lambda*omega^2*mu^2, and omega is moved to
+ *   the optimum 2/(1+sqrt(1-mu^2)) for the next solve. Ratios at or below omega-1 carry no
+ *   information about mu (omega is then above the optimum) and lower omega towards 1 instead.
+ * Inputs : int n (number of steps)
+ *          double* a (length=3*n), stores tridiagonal matrix
+ *          double* b (length=n), stores right hand side
+ *          double* obstacle (length=n, or null for a plain linear solve)
+ *          double* x (length=n), initial guess
+ *          FDM_sor_control* ctl, relaxation, tolerance and statistics
+ * Output : double* x (written in place), where a*x = b (or the projected solution)
+ *          returns the number of sweeps
+ */
+int psor_method(int n, const double *a, const double *b, const double *obstacle, double *x, FDM_sor_control *ctl) {
+  int iter;
+  double omega = ctl->omega, change_max, change_prev = 0.0, ratio = 0.0, mu2;
+
+  // main diagonal is stored in a[3*i+1]
+  // sub diagonal is stored in a[3*i]
+  // sup diagonal is stored in a[3*i+2]
+  for(iter=1; iter<=ctl->max_iter; iter++) {
+    change_max = (obstacle != 0) ? psor_sweep<true>(n, a, b, obstacle, x, omega)
+                                 : psor_sweep<false>(n, a, b, obstacle, x, omega);
+    if(change_prev > 0.0) ratio = change_max/change_prev;
+    change_prev = change_max;
+    if(change_max <= ctl->tol) break;
+  }
+  if(iter > ctl->max_iter) {
+    iter = ctl->max_iter;
+    ctl->unconverged++;
+  }
+
+  FDM_PROFILE_SOR(iter, change_max, change_max <= ctl->tol);
+  ctl->iterations = iter;
+  if(iter > ctl->max_iterations) ctl->max_iterations = iter;
+  ctl->total_iterations += iter;
+  ctl->solves++;
+
+  // the rate of the last sweeps estimates mu once a few sweeps were needed
+  if(ctl->adapt_omega && iter >= 3 && ratio > 0.0 && ratio < 1.0) {
+    if(ratio > omega - 1.0) {
+      mu2 = (ratio + omega - 1.0)*(ratio + omega - 1.0)/(ratio*omega*omega);
+      if(mu2 < 1.0) ctl->omega = 2.0/(1.0 + sqrt(1.0 - mu2));
+    } else {
+      ctl->omega = 1.0 + 0.5*(omega - 1.0);
+    }
+  }
+  return iter;
+}
+
+/**
+ * Brennan-Schwartz algorithm: direct solve of the linear complementarity problem
+ *   a*x >= b, x >= obstacle, (a*x - b)*(x - obstacle) = 0
+ * of one American time step. The matrix is eliminated towards the end of the grid where the
+ * option is held and the constraint is applied during the substitution that starts in the
+ * exercise region, so each step costs one O(n) sweep in each direction like thomas_method.
+ * The exercise region must be one interval at the end of the grid, which holds for calls
+ * (large x) and puts (small x) under Black-Scholes.
+ * Inputs : int n (number of steps)
+ *          double* a (length=3*n), stores tridiagonal matrix
+ *          double* b (length=n), stores right hand side
+ *          double* obstacle (length=n), early exercise value
+ *          int call_or_put (+1 for call, exercise at the top of the grid; -1 for put, at the bottom)
+ *          FDM_workspace* ws (capacity >= n), scratch space
+ * Output : double* x (length=n, written in place), x >= obstacle
+ */
+void brennan_schwartz(int n, const double *a, const double *b, const double *obstacle, int call_or_put, double *x, FDM_workspace *ws) {
+  int i;
+  double m;
+  double *diag_new = ws->diag_new;
+  double *b_new = ws->b_new;
+
+  // main diagonal is stored in a[3*i+1]
+  // sub diagonal is stored in a[3*i]
+  // sup diagonal is stored in a[3*i+2]
+  if(call_or_put > 0) {
+    // eliminate the sub diagonal downwards, then substitute back from the exercise region at x[n-1]
+    diag_new[0] = a[3*0+1];
+    b_new[0] = b[0];
+    for(i=1; i<n; i++) {
+      m = a[3*i]/diag_new[i-1];
+      diag_new[i] = a[3*i+1] - m*a[3*(i-1)+2];
+      b_new[i] = b[i] - m*b_new[i-1];
+    }
+    x[n-1] = fmax(b_new[n-1]/diag_new[n-1], obstacle[n-1]);
+    for(i=n-2; i>=0; i--) {
+      x[i] = fmax((b_new[i] - a[3*i+2]*x[i+1])/diag_new[i], obstacle[i]);
+    }
+  } else {
+    // eliminate the sup diagonal upwards, then substitute forward from the exercise region at x[0]
+    diag_new[n-1] = a[3*(n-1)+1];
+    b_new[n-1] = b[n-1];
+    for(i=n-2; i>=0; i--) {
+      m = a[3*i+2]/diag_new[i+1];
+      diag_new[i] = a[3*i+1] - m*a[3*(i+1)];
+      b_new[i] = b[i] - m*b_new[i+1];
+    }
+    x[0] = fmax(b_new[0]/diag_new[0], obstacle[0]);
+    for(i=1; i<n; i++) {
+      x[i] = fmax((b_new[i] - a[3*i]*x[i-1])/diag_new[i], obstacle[i]);
+    }
+  }
+}
+
+/**
+ * The factorization shared in opts when it was built for the same M and theta and either the
+ * same w on the uniform grid or the same grid and dtau
+ * Inputs : const FDM_options *opts (may be null)
+ *          int M, double w, dtau, theta (grid size, dtau/dx^2, step size in time, scheme weight)
+ * Output : returns the shared factorization, null when there is none or it does not match
+ */
+const FDM_tridiag_factor *shared_heat_operator(const FDM_options *opts, int M, double w, double dtau, double theta) {
+  const double *grid = (opts != 0) ? opts->grid : 0;
+  const FDM_tridiag_factor *f = (opts != 0) ? opts->factor : 0;
+
+  if(f != 0 && f->n == M && f->theta == theta && f->grid == grid && (grid != 0 ? f->dtau == dtau : f->w == w)) {
+    return f;
+  }
+  return 0;
+}
+
+/**
+ * Factorized matrix of the implicit (theta=1) or Crank-Nicholson (theta=0.5) step of an engine
+ *   The factorization shared in opts is used when it matches (see shared_heat_operator);
+ *   otherwise one is built.
+ * Inputs : const FDM_options *opts (may be null)
+ *          int M, double w, dtau, theta (grid size, dtau/dx^2, step size in time, scheme weight)
+ * Output : FDM_tridiag_factor *local (built when the shared one does not match, freed by the caller)
+ *          returns the factorization to solve with
+ */
+const FDM_tridiag_factor *heat_operator(const FDM_options *opts, int M, double w, double dtau, double theta, FDM_tridiag_factor *local) {
+  const double *grid = (opts != 0) ? opts->grid : 0;
+  const FDM_tridiag_factor *f = shared_heat_operator(opts, M, w, dtau, theta);
+
+  if(f != 0) return f;
+  if(grid != 0) heat_operator_factor(M, grid, dtau, theta, local);
+  else heat_operator_factor(M, w, theta, local);
+  return local;
+}
+
+/**
+ * Copies time layer j into the snapshot buffers of opts that requested it
+ * Inputs : const FDM_options *opts (may be null, then nothing is stored)
+ *          int j (time index of the layer)
+ *          int M (number of points in space)
+ *          double* y (length=M), the layer itself
+ */
+void store_snapshot(const FDM_options *opts, int j, int M, const double *y) {
+  int k;
+
+  if(opts == 0 || opts->snapshots == 0) return;
+
+  for(k=0; k<opts->n_snapshots; k++) {
+    if(opts->snapshot_layers[k] == j) {
+      copy(y, y+M, opts->snapshots+k*M);
+    }
+  }
+}
+
+/**
+ * Cubic (4 point Lagrange) interpolation of a function tabulated on an increasing grid
+ * Inputs : int n (number of points, n >= 2)
+ *          double* x (length=n), increasing grid
+ *          double* y (length=n), values on the grid
+ *          double xq, query point; outside [x[0], x[n-1]] the end value is returned
+ * Output : double, interpolated value at xq
+ */
+double interpolate_cubic(int n, const double *x, const double *y, double xq) {
+  int lo = 0, hi = n-1, mid, k, m, l;
+  double value, weight;
+
+  if(xq <= x[0]) return y[0];
+  if(xq >= x[n-1]) return y[n-1];
+
+  // bisection for x[lo] <= xq < x[lo+1]
+  while(hi - lo > 1) {
+    mid = (lo + hi)/2;
+    if(x[mid] <= xq) lo = mid;
+    else hi = mid;
+  }
+
+  if(n < 4) {
+    return y[lo] + (y[lo+1]-y[lo])*(xq-x[lo])/(x[lo+1]-x[lo]);
+  }
+
+  // stencil x[k] .. x[k+3] around the interval, shifted inwards at the ends
+  k = min(max(lo-1, 0), n-4);
+  value = 0.0;
+  for(m=k; m<k+4; m++) {
+    weight = 1.0;
+    for(l=k; l<k+4; l++) {
+      if(l != m) weight *= (xq - x[l])/(x[m] - x[l]);
+    }
+    value += weight*y[m];
+  }
+  return value;
+}
+
+/**
+ * Grid in x clustered around x_center: x = x_center + density*sinh(xi) with xi uniform, so the
+ * spacing is about density*dxi near x_center and grows exponentially into the tails.
+ * With x_center midway between x_min and x_max and n odd, x_center is itself a node.
+ * Inputs : int n (number of points)
+ *          double x_min, x_max (end points)
+ *          double x_center (point of highest density, e.g. 0 for the strike)
+ *          double density (smaller values cluster more strongly; large values tend to uniform)
+ * Output : double* x (length=n), increasing grid
+ */
+void sinh_grid(int n, double x_min, double x_max, double x_center, double density, double *x) {
+  int i;
+  double xi_min = asinh((x_min - x_center)/density);
+  double xi_max = asinh((x_max - x_center)/density);
+
+  for(i=0; i<n; i++) {
+    x[i] = x_center + density*sinh(xi_min + i*(xi_max - xi_min)/(n-1));
+  }
+  x[0] = x_min;
+  x[n-1] = x_max;
+  if(n%2 == 1 && fabs(x_center - 0.5*(x_min + x_max)) < 1e-14) x[n/2] = x_center;
+}
+
+/**
+ * Weights of the three point second derivative on a non-uniform grid, times dtau
+ *   y_xx(x[i]) ~ 2/(h_m+h_p) * ((y[i+1]-y[i])/h_p - (y[i]-y[i-1])/h_m)
+ *   lw[i] = 2*dtau/(h_m*(h_m+h_p)), uw[i] = 2*dtau/(h_p*(h_m+h_p))
+ *   and at the end points, which carry the boundary rows, dtau/h^2 of the end interval.
+ * On a uniform grid all of them reduce to w = dtau/dx^2.
+ * Inputs : int n, double* x (length=n), double dtau
+ * Output : double* lw, uw (length=n)
+ */
+void grid_weights(int n, const double *x, double dtau, double *lw, double *uw) {
+  int i;
+  double h_m, h_p;
+
+  for(i=1; i<n-1; i++) {
+    h_m = x[i] - x[i-1];
+    h_p = x[i+1] - x[i];
+    lw[i] = 2.0*dtau/(h_m*(h_m+h_p));
+    uw[i] = 2.0*dtau/(h_p*(h_m+h_p));
+  }
+  h_p = x[1] - x[0];
+  lw[0] = uw[0] = dtau/(h_p*h_p);
+  h_m = x[n-1] - x[n-2];
+  lw[n-1] = uw[n-1] = dtau/(h_m*h_m);
+}
+
+/**
+ * Value of the option at spot S read off the final layer of an engine
+ * Inputs : double S, K (spot and strike)
+ *          double alpha, beta_tau (transformation V = K*exp(alpha*x + beta*tau)*y)
+ *          int M, double* x, double* y (grid and final layer)
+ * Output : double, value of the option at x = log(S/K), NaN when S or K is not above 0 or
+ *          x lies off the grid [x[0], x[M-1]], where the layer says nothing about the option
+ */
+double value_at_spot(double S, double K, double alpha, double beta_tau, int M, const double *x, const double *y) {
+  double xq = log(S/K);
+
+  if(!(S > 0.0 && K > 0.0 && xq >= x[0] && xq <= x[M-1])) return NAN;
+  return interpolate_cubic(M, x, y, xq)*K*exp(alpha*xq+beta_tau);
+}
+
+/**
+ * Values the spot ladder requested in opts from the final layer of an engine
+ * Inputs : const FDM_options *opts (may be null, then nothing is stored)
+ *          double K, alpha, beta_tau, int M, double* x, double* y (as for value_at_spot)
+ */
+void store_spot_values(const FDM_options *opts, double K, double alpha, double beta_tau, int M, const double *x, const double *y) {
+  int k;
+
+  if(opts == 0 || opts->spot_values == 0) return;
+
+  for(k=0; k<opts->n_spots; k++) {
+    opts->spot_values[k] = value_at_spot(opts->spots[k], K, alpha, beta_tau, M, x, y);
+  }
+}
+
+/**
+ * Values the strike ladder requested in opts from the final layer of an engine;
+ * the layer is strike invariant, each strike only changes x = log(S/K) and the scale K
+ * Inputs : const FDM_options *opts (may be null, then nothing is stored)
+ *          double S, alpha, beta_tau, int M, double* x, double* y (as for value_at_spot)
+ */
+void store_strike_values(const FDM_options *opts, double S, double alpha, double beta_tau, int M, const double *x, const double *y) {
+  int k;
+
+  if(opts == 0 || opts->strike_values == 0) return;
+
+  for(k=0; k<opts->n_strikes; k++) {
+    opts->strike_values[k] = value_at_spot(S, opts->strikes[k], alpha, beta_tau, M, x, y);
+  }
+}
+
+/**
+ * Prices a chain of strikes with a single march of one of the engines
+ * Inputs : FDM_engine engine (ExplicitFDM, ImplicitFDM, CN_FDM, ImplicitSORFDM or CN_SORFDM)
+ *          double S (spot price)
+ *          int n, double* strikes (length=n)
+ *          double r, q, sigma, expiry, dx, dtau, int call_or_put, amer_or_eur (as for the engines)
+ * Output : double* values (length=n), value of the option at each strike
+ */
+void price_strikes(FDM_engine engine, double S, int n, const double *strikes, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur, double *values) {
+  FDM_options opts;
+
+  if(n <= 0) return;
+
+  opts.n_strikes = n;
+  opts.strikes = strikes;
+  opts.strike_values = values;
+  engine(S, strikes[0], r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &opts);
+}
+
+/**
+ * Captures the maturities of the term strip in opts that fall between two consecutive layers
+ * Inputs : const FDM_options *opts (may be null, then nothing is stored)
+ *          int last_step (1 on the final step, expiries beyond tau are then extrapolated)
+ *          double S, K, sigma, alpha, beta (as in the engines)
+ *          double tau_prev, tau (times of the layers; equal for the initial layer)
+ *          int M, double* x, double* y_prev, double* y (grid and the two layers)
+ */
+void store_expiry_values(const FDM_options *opts, int last_step, double S, double K, double sigma, double alpha, double beta, double tau_prev, double tau, int M, const double *x, const double *y_prev, const double *y) {
+  int k;
+  double tau_k, theta;
+
+  if(opts == 0 || opts->expiry_values == 0) return;
+
+  for(k=0; k<opts->n_expiries; k++) {
+    tau_k = 0.5*sigma*sigma*opts->expiries[k];
+    if((tau_k <= tau || last_step) && (tau_k > tau_prev || tau == tau_prev)) {
+      // linear in tau between the layers, the exp(beta*tau) scale is applied exactly
+      theta = (tau > tau_prev) ? (tau_k - tau_prev)/(tau - tau_prev) : 1.0;
+      opts->expiry_values[k] = (1.0 - theta)*value_at_spot(S, K, alpha, beta*tau_k, M, x, y_prev)
+                               + theta*value_at_spot(S, K, alpha, beta*tau_k, M, x, y);
+    }
+  }
+}
+
+/**
+ * Prices a term strip of maturities with a single march of one of the engines
+ * Inputs : FDM_engine engine (ExplicitFDM, ImplicitFDM, CN_FDM, ImplicitSORFDM or CN_SORFDM)
+ *          double S, K (spot and strike)
+ *          int n, double* expiries (length=n)
+ *          double r, q, sigma, dx, dtau, int call_or_put, amer_or_eur (as for the engines)
+ * Output : double* values (length=n), value of the option at each maturity
+ */
+void price_expiries(FDM_engine engine, double S, double K, int n, const double *expiries, double r, double q, double sigma, double dx, double dtau, int call_or_put, int amer_or_eur, double *values) {
+  FDM_options opts;
+  double expiry = 0.0;
+  int k;
+
+  if(n <= 0) return;
+
+  for(k=0; k<n; k++) {
+    expiry = max(expiry, expiries[k]);
+  }
+  opts.n_expiries = n;
+  opts.expiries = expiries;
+  opts.expiry_values = values;
+  engine(S, K, r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &opts);
+}
+
+/**
+ * Price, delta, gamma and theta from the last two layers of an engine, and the scale of the final layer
+ *   delta and gamma use central differences in x = log(S/K) with the local grid spacing,
+ *   theta the backward difference between the layers, with dtau = -0.5*sigma^2*dt
+ * Inputs : const FDM_options *opts (may be null or have no result, then nothing is stored)
+ *          double S, K, sigma, alpha, beta (as in the engines)
+ *          double tau, tau_prev (times of the final and penultimate layers)
+ *          int M, double* x, double* y, double* y_prev (grid, final and penultimate layers)
+ */
+void store_greeks(const FDM_options *opts, double S, double K, double sigma, double alpha, double beta, double tau, double tau_prev, int M, const double *x, const double *y, const double *y_prev) {
+  FDM_result *res;
+  double xq = log(S/K), h, v, v_up, v_down, v_x, v_xx;
+  int i;
+
+  if(opts == 0 || opts->result == 0) return;
+  res = opts->result;
+
+  i = upper_bound(x, x+M, xq) - x;
+  i = min(max(i, 1), M-1);
+  h = x[i] - x[i-1];
+
+  v = value_at_spot(S, K, alpha, beta*tau, M, x, y);
+  v_up = value_at_spot(S*exp(h), K, alpha, beta*tau, M, x, y);
+  v_down = value_at_spot(S*exp(-h), K, alpha, beta*tau, M, x, y);
+  v_x = (v_up - v_down)/(2.0*h);
+  v_xx = (v_up - 2.0*v + v_down)/(h*h);
+
+  res->price = v;
+  res->delta = v_x/S;
+  res->gamma = (v_xx - v_x)/(S*S);
+  res->theta = 0.0;
+  if(tau > tau_prev) {
+    res->theta = -0.5*sigma*sigma*(v - value_at_spot(S, K, alpha, beta*tau_prev, M, x, y_prev))/(tau - tau_prev);
+  }
+  res->expiry_solved = tau/(0.5*sigma*sigma);
+  res->alpha = alpha;
+  res->beta_tau = beta*tau;
+}
+
+/**
+ * Vega and rho by central bumps of sigma and r, each bumped run reusing the workspace and
+ * factorization of the original call (w = dtau/dx^2 does not depend on sigma or r).
+ * The march stops at the last whole step, expiry_solved <= expiry, and a bump in sigma can
+ * change the number of steps; each bumped price is therefore carried to the full expiry with
+ * its own theta before differencing, which keeps vega smooth in sigma.
+ * The bumped runs adapt a copy of opts->sor, so its omega and counts stay those of the caller's run.
+ */
+void store_bumped_greeks(const FDM_options *opts, FDM_engine engine, FDM_workspace *ws, const FDM_tridiag_factor *op, double S, double K, double r, double q, double sigma, double expiry, double dx, double dtau, int call_or_put, int amer_or_eur) {
+  FDM_options bump;
+  FDM_sor_control sor;
+  FDM_result up, down;
+  double d_sigma = 1e-3, d_r = 1e-4, v_up, v_down;
+
+  if(opts == 0 || opts->result == 0 || opts->bump_greeks == 0) return;
+
+  bump.workspace = ws;
+  bump.factor = op;
+  bump.american_solver = opts->american_solver;
+  if(opts->sor != 0) {
+    sor = *opts->sor;
+    bump.sor = &sor;
+  }
+  bump.n_grid = opts->n_grid;
+  bump.grid = opts->grid;
+  bump.rannacher_steps = opts->rannacher_steps;
+  bump.solver_threads = opts->solver_threads;
+
+  bump.result = &up;
+  engine(S, K, r, q, sigma+d_sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &bump);
+  bump.result = &down;
+  engine(S, K, r, q, sigma-d_sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &bump);
+  v_up = up.price - up.theta*(expiry - up.expiry_solved);
+  v_down = down.price - down.theta*(expiry - down.expiry_solved);
+  opts->result->vega = (v_up - v_down)/(2.0*d_sigma);
 
+  bump.result = &up;
+  engine(S, K, r+d_r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &bump);
+  bump.result = &down;
+  engine(S, K, r-d_r, q, sigma, expiry, dx, dtau, call_or_put, amer_or_eur, &bump);
+  opts->result->rho = (up.price - down.price)/(2.0*d_r);
 }
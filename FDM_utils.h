@@ -1,7 +1,110 @@
 #ifndef FDM_UTILS_H
 #define FDM_UTILS_H
 
+struct FDM_partition_team;
+
+/**
+ * Scratch storage for the tridiagonal solvers.
+ * Created once per pricing call (or once per thread) and handed to the in-place solvers,
+ * so no memory is allocated inside the time loop of the engines. The team of threads of the
+ * partitioned solves is kept here as well, so an engine call on a very fine grid (and each of
+ * its bumped runs) does not start and join one of its own.
+ */
+struct FDM_workspace {
+  int n = 0;              // capacity of each buffer
+  double *diag_new = 0;   // thomas_method, brennan_schwartz: eliminated main diagonal
+  double *b_new = 0;      // thomas_method, brennan_schwartz: eliminated right hand side
+  double *x_new = 0;      // sor_method: next iterate
+  FDM_partition_team *team = 0; // partition_factor: threads of the solves, started on first use
+};
+
+/**
+ * LU factorization of a tridiagonal matrix, computed once and reused for many right hand sides.
+ * The multipliers and reciprocal pivots are stored so that each solve is a division-free
+ * forward/back substitution. The matrix depends only on the grid size, w = dtau/dx^2 and the
+ * scheme weight theta (1 implicit, 0.5 Crank-Nicholson), so one factorization built with
+ * heat_operator_factor can be shared by every option priced with the same n, w and theta.
+ * On a non-uniform grid it depends on the grid and dtau instead of w.
+ */
+struct FDM_tridiag_factor {
+  int n = 0;
+  double w = 0.0;         // w and theta the operator was built with (heat_operator_factor only)
+  double theta = 0.0;
+  const double *grid = 0; // non-uniform grid and dtau the operator was built with, if any
+  double dtau = 0.0;
+  double *lower = 0;      // lower[i] = sub[i]/pivot[i-1], elimination multipliers
+  double *upper = 0;      // upper[i] = sup[i], super diagonal
+  double *inv_pivot = 0;  // 1/pivot[i]
+};
+
+/**
+ * Partitioned (SPIKE) factorization of a tridiagonal matrix for very fine grids, where the serial
+ * dependency chain of a Thomas solve is the bottleneck. The rows are split into blocks that are
+ * solved independently, several side by side in each thread and the threads of a team at once,
+ * and tied together by a small system over the block edges (see partition_factor).
+ */
+struct FDM_partition_factor {
+  int n = 0;
+  int n_blocks = 0;             // P
+  int block = 0;                // rows per block, the last block also takes n - P*block more
+  int n_threads = 1;
+  double *lower = 0;            // LU of each block on its own, as in FDM_tridiag_factor
+  double *upper = 0;
+  double *inv_pivot = 0;
+  double *spike_left = 0;       // response of each block to the unknown before it
+  double *spike_right = 0;      // response of each block to the unknown after it
+  double *reduced = 0;          // factorized system of the P-1 block edges, 6 per edge
+  double *rhs = 0;              // solution of that system during a solve, 2 per edge
+  FDM_partition_team *team = 0; // threads of the solves, null when n_threads is 1
+  int shared_team = 0;          // 1 when the team is that of a workspace and outlives the factorization
+};
+
+/**
+ * Settings and statistics of psor_method, kept between calls so that the relaxation factor
+ * tuned on one time step carries over to the next (the matrix of a march does not change).
+ */
+struct FDM_sor_control {
+  double omega = 1.2;          // relaxation factor, updated after each solve when adapt_omega is set
+  int adapt_omega = 1;         // 1 to move omega towards the optimum estimated from the convergence rate
+  double tol = 1e-9;           // stop once the largest update of a sweep is below tol
+  int max_iter = 200;          // sweeps per solve at most
+  int iterations = 0;          // sweeps of the last solve
+  int max_iterations = 0;      // most sweeps of any solve
+  long total_iterations = 0;   // sweeps summed over all solves
+  long solves = 0;             // number of solves
+  long unconverged = 0;        // solves that stopped at max_iter
+};
+
+void workspace_reserve(FDM_workspace *ws, int n);
+void workspace_free(FDM_workspace *ws);
+
 double* thomas_method(int n, double *a, double *b);
 double* sor_method(int n, double *a, double *b, double relax, int max_iter);
 
-#endif 
\ No newline at end of file
+void thomas_method(int n, const double *a, const double *b, double *x, FDM_workspace *ws);
+void sor_method(int n, const double *a, const double *b, double *x, double relax, int max_iter, FDM_workspace *ws);
+int psor_method(int n, const double *a, const double *b, const double *obstacle, double *x, FDM_sor_control *ctl);
+void brennan_schwartz(int n, const double *a, const double *b, const double *obstacle, int call_or_put, double *x, FDM_workspace *ws);
+
+void tridiag_factor(int n, const double *a, FDM_tridiag_factor *f);
+void heat_operator_matrix(int n, const double *lw, const double *uw, double theta, double *a);
+void heat_operator_factor(int n, double w, double theta, FDM_tridiag_factor *f);
+void heat_operator_factor(int n, const double *grid, double dtau, double theta, FDM_tridiag_factor *f);
+void tridiag_factor_free(FDM_tridiag_factor *f);
+void tridiag_solve(const FDM_tridiag_factor *f, const double *b, double *x);
+
+// from this size on the factored theta step solves with partition_factor rather than tridiag_factor
+#define FDM_PARTITION_MIN_N 8192
+
+int partition_threads(int requested);
+void partition_factor(int n, const double *a, int n_threads, FDM_partition_factor *f, FDM_workspace *ws = 0);
+void partition_factor_free(FDM_partition_factor *f);
+void partition_team_free(FDM_partition_team *team);
+void partition_solve(FDM_partition_factor *f, const double *b, double *x);
+
+double interpolate_cubic(int n, const double *x, const double *y, double xq);
+
+void sinh_grid(int n, double x_min, double x_max, double x_center, double density, double *x);
+void grid_weights(int n, const double *x, double dtau, double *lw, double *uw);
+
+#endif